@@ -10,13 +10,26 @@ static int draw_input = 1;                  /* -noi option; if 0, the input will
 static int incremental = 0;                 /* -r  option; if 1, outputs text each time a key is pressed */
 static const unsigned int alpha = 0xdd;
 static int fuzzy = 1;                      /* -F  option; if 0, dmenu doesn't use fuzzy matching     */
+static unsigned int fuzzytop = 1000;        /* fuzzy matches sorted up front, the rest when paged to */
+static size_t matchcache = 32 << 20;        /* bytes of match results kept for repeated queries */
+static unsigned int threads = 0;            /* -t  option; matcher threads, 0 uses one per CPU */
+static unsigned int threadmin = 100000;     /* inputs smaller than this are matched on one thread */
+static unsigned int trigrammin = 100000;    /* index inputs this large for substring matching, 0 never */
+static unsigned int asyncmin = 50000;       /* match inputs this large off the event loop, 0 never */
+static int stream = 0;                      /* -S  option; if 1, shows the menu while stdin is read */
+static int nulsep = 0;                      /* -0  option; if 1, items and output end in NUL, not newline */
+static int records = 0;                     /* -B  option; if 1, stdin holds length-prefixed records */
+static int history = 0;                     /* -H  option; if 1, ranks items chosen before first */
+static unsigned int histslots = 4096;       /* items the history remembers, a power of two */
 static int centered = 0;                    /* -c option; centers dmenu on screen */
 static int min_width = 500;                    /* minimum width when centered */
+static unsigned int widthmin = 10000;       /* -c measures inputs this large after showing the menu */
 /* -fn option overrides fonts[0]; default X11 font or font set */
 static char font[] = "monospace:size=10";
 static char *fonts[]   = {font, "JetBrainsMono Nerd Font:pixelsize=14:antialias=true:autohint=true", "JoyPixels:size=12:antialias=true:autohint=true" };
 static char *prompt      = ">>>";      /* -p  option; prompt to the left of input field */
 static const char *dynamic     = NULL;      /* -dy option; dynamic command to run on input change */
+static const char *provider    = NULL;      /* -dp option; command kept running, queried on input change */
 
 static char normfgcolor[] = "#bbbbbb";
 static char normbgcolor[] = "#222222";
@@ -2,15 +2,24 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,6 +34,7 @@
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
+#include "search.h"
 #include "util.h"
 
 /* macros */
@@ -46,36 +56,230 @@ enum {
   SchemeOut,
   SchemeLast
 }; /* color schemes */
-
-struct item {
-  char *text;
-  struct item *left, *right;
-  int out, hp;
+enum {
+  TierExact,
+  TierHist,
+  TierHpPrefix,
+  TierPrefix,
+  TierSubstr,
+  TierLast
+}; /* match order */
+
+enum { ItemHp = 1, ItemOut = 2, ItemValue = 4, ItemIndex = 8 }; /* item flags */
+enum { RecHp = 1, RecIndex = 2, RecDisplay = 4 }; /* -B record flags */
+
+/* a fuzzy match and its distance to the query */
+struct rank {
   double distance;
-  int index;
+  unsigned int item;
 };
 
+/* filters source positions [lo, hi) into matchset[lo, lo + len) */
+struct matchchunk {
+  size_t lo, hi, len;
+  size_t ntier[TierLast];
+  int cancelled;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  struct matchchunk *chunks;
+  size_t nchunks, next, finished;
+  unsigned int nthreads;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+          PTHREAD_COND_INITIALIZER};
+
+/* background matcher, runs the match passes requested by the event loop */
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int started, quit, fd[2]; /* fd[0] becomes readable when a pass finished */
+  unsigned int want;        /* generation of the latest request */
+  unsigned int done;        /* generation of the last finished pass */
+  char text[BUFSIZ];        /* text of the latest request */
+} bg = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* trigram index, the postings of bucket b are post[start[b], start[b + 1]) */
+#define TRIBITS 18
+#define TRIBUCKETS (1U << TRIBITS)
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int started, cancel;
+  size_t *start;
+  unsigned int *post;
+} tri = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* filter results of recent queries, see cacheget() */
+static struct {
+  struct {
+    char *text;
+    int mode;
+    unsigned int *set;
+    void *aux; /* matchtier of set, or the distances of fuzzy matches to a query */
+    size_t len, bytes, ntier[TierLast];
+    unsigned long used;
+  } e[32];
+  size_t bytes;
+  unsigned long clock;
+} cache;
+
 static struct {
   pid_t pid;
   int enable, in[2], out[2];
   char buf[256];
 } qalc;
 
+/* the long-lived -dp command: it reads one query per line, "id\ttext", and
+ * answers with lines "id\titem", ending each batch with a line "id"; batches
+ * for an id other than the latest are dropped */
+static struct {
+  pid_t pid;
+  int in, out;
+  unsigned long want, got;
+  int done, resend;
+  char query[BUFSIZ + 32];
+  size_t qlen, qoff;
+  char *buf;
+  size_t len, siz;
+} prov = {.in = -1, .out = -1};
+
+/* The -H history is a hash table of the items chosen before, shared by all
+ * menus through a mapping of its file: each slot holds the hash of an item's
+ * value, how often and when it was last chosen. An item is looked for in the
+ * HISTPROBE slots from its hash on, the least valued of them makes way for a
+ * new one. */
+#define HISTMAGIC "dmenuhst"
+#define HISTVERSION 1
+#define HISTPROBE 16
+struct histhdr {
+  char magic[8];
+  uint32_t version, nslots;
+};
+struct histslot {
+  uint64_t hash;
+  uint32_t count, last;
+};
+static struct {
+  int fd;
+  void *map;
+  struct histslot *slots;
+  size_t size;
+  uint32_t mask, now;
+} hist = {.fd = -1};
+
 static const char **hpitems = NULL;
 static int hplength = 0;
+
+/* item sets the daemon reads at startup, shown by -set instead of stdin */
+static struct {
+  const char *name;
+  char *text;
+  size_t len, siz;
+  void *off;
+  int wideoff;
+  uint64_t *mask;
+  unsigned char *flags;
+  size_t n, nsiz;
+} *sets = NULL;
+static size_t nsets = 0;
+static const char *setname = NULL;
+static const char *snapfile = NULL; /* -cache */
 static char numbers[NUMBERSBUFSIZE] = "";
 static char text[BUFSIZ] = "";
 static char *embed;
 static int bh, mw, mh;
+/* what the last frame shows, by keys of the top line and of the rows of a
+ * vertical list, and the lines damaged in the current one */
+static struct {
+  int valid, y0, y1;
+  uint64_t top, *rows;
+  unsigned int nrows;
+} frame;
+/* -c: the monitor the menu is centered on, the widest item the menu was
+ * sized for and the widest of the items before next */
+#define ESTITEMS 64
+static struct {
+  int x, w, y;
+  int textw, max;
+  size_t next;
+} fit;
 static int inputw = 0, promptw, passwd = 0;
 static int lrpad; /* sum of left and right padding */
 static size_t cursor;
-static struct item *items = NULL;
-static struct item *matches, *matchend;
-static struct item *prev, *curr, *next, *sel;
+/* The items are parallel arrays holding just what the match loops read, 13
+ * bytes per item: the offset of its text, which also locates its key, the
+ * byte classes in it (see searchmask()) and its flags. All text is kept in
+ * one buffer, or in the mapping of stdin, and with -i the case-folded keys in
+ * a second one at the same offsets. Offsets are 32 bit until the text grows
+ * past 4 GiB, then the array is widened to 64 bit, see widenoffsets(). */
+#define ITEMOFF(i)                                                             \
+  (wideoff ? ((uint64_t *)itemoff)[i] : ((uint32_t *)itemoff)[i])
+#define OFFSIZE (wideoff ? sizeof(uint64_t) : sizeof(uint32_t))
+#define ITEMTEXT(i) (inputtext + ITEMOFF(i))
+#define ITEMKEY(i) (inputkeys + ITEMOFF(i))
+static char *inputtext = NULL, *inputkeys = NULL;
+static size_t inputlen = 0, inputsiz = 0, inputmapsize = 0;
+/* the mapping holding the text, of stdin or of a -cache snapshot; with a
+ * snapshot the keys and item arrays lie in it as well */
+static void *inputmap = NULL;
+static int itemsmapped = 0;
+static void *itemoff = NULL;
+static int wideoff = 0;
+static uint64_t *itemmask = NULL;
+static unsigned char *itemflags = NULL;
+/* text widths without padding, measured when first needed, see itemw(), or
+ * read from a -cache snapshot for the fonts named in it */
+#define WIDTHUNKNOWN UINT16_MAX
+static uint16_t *itemwidth = NULL;
+static size_t nwidths = 0;
+static int widthsmapped = 0;
+static int widthsall = 0; /* no mapped width is WIDTHUNKNOWN */
+/* with -H, the history hashes of the values of the first nhashed items, see
+ * histitems() */
+static uint64_t *itemhist = NULL;
+static size_t nhashed = 0, histsiz = 0;
+static size_t nitems = 0, itemsiz = 0;
+static int streaming = 0; /* stdin is still being read, see readstream() */
+/* the matches in display order, as item indices; curr, sel, prev and next are
+ * positions in it */
+static unsigned int *matchlist = NULL;
+static size_t nmatches = 0, matchlistsiz = 0;
+/* indices of the items that passed the last filter, in ascending order; while
+ * the query only grows the next filter narrows this set instead of items */
+static unsigned int *matchset = NULL;
+/* a filter pass reads matchsrc (all items if NULL) and writes matchnext along
+ * with the tier and fuzzy distance of each match, matchnext then becomes
+ * matchset; an abandoned pass leaves matchset intact */
+static unsigned int *matchnext = NULL, *matchsrc = NULL;
+static unsigned char *matchtier = NULL;
+static double *matchdist = NULL;
+static size_t matchsetlen = 0, matchsrclen = 0, matchsetsiz = 0;
+static size_t ntier[TierLast];
+static char matchsettext[BUFSIZ] = "";
+static int matchsetvalid = 0;
+/* the query of the current match pass, shared with the worker threads */
+static char query[BUFSIZ] = "";
+static char **tokv = NULL;
+static int tokc = 0, tokn = 0, textlen = 0;
+static size_t toklen = 0, textsize = 0;
+static uint64_t textmask = 0;
+static unsigned int passgen = 0;
+/* fuzzy matches in list order, only the first nranked are sorted yet; a pass
+ * ranks into rankbuf, which is swapped with ranked once it is shown */
+static struct rank *ranked = NULL, *rankbuf = NULL;
+static size_t nranked = 0, nrankable = 0, rankedsiz = 0, rankbufsiz = 0;
+static size_t nrankbuf = 0, krankbuf = 0;
+static int matchpending = 0;
+/* the event loop matches and redraws once per batch of queued events */
+static int matchstale = 0, redraw = 0;
+static size_t prev, curr, next, sel;
 static int mon = -1, screen;
 static unsigned int max_lines = 0;
 static int print_index = 0;
+static int stats = 0;
 
 static Atom clip, utf8;
 static Display *dpy;
@@ -104,19 +308,64 @@ static void resource_load(XrmDatabase db, char *name, enum resource_type rtype,
 
 #include "config.h"
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static int casefold = 0; /* -i, match against case-folded keys */
+static char delim = '\n'; /* ends input lines and output, NUL with -0 and -B */
 static void xinitvisual();
+static void usage(void);
+static void rankrest(void);
+static void match(void);
+static void bgstop(void);
+static void tristop(void);
+static void cacheclear(void);
+static void matchsync(void);
+static void histitems(void);
+static void freeinput(void);
+static void growitems(void);
+static void addline(const char *s, size_t len);
+static void snapwidths(void);
+
+/* forgets the item widths, for other items or fonts */
+static void dropwidths(void) {
+  if (!widthsmapped)
+    free(itemwidth);
+  itemwidth = NULL;
+  nwidths = 0;
+  widthsmapped = widthsall = 0;
+}
 
-static unsigned int textw_clamp(const char *str, unsigned int n) {
-  unsigned int w = drw_fontset_getwidth_clamp(drw, str, n) + lrpad;
-  return MIN(w, n);
+/* the width of the text of item i without padding */
+static unsigned int itemw(unsigned int i) {
+  uint16_t *w;
+  size_t n;
+
+  if (i >= nwidths) {
+    n = MAX(nitems, 2 * nwidths);
+    if (!(w = malloc(n * sizeof *w)))
+      die("cannot malloc %zu bytes:", n * sizeof *w);
+    if (nwidths)
+      memcpy(w, itemwidth, nwidths * sizeof *w);
+    memset(w + nwidths, 0xff, (n - nwidths) * sizeof *w);
+    if (!widthsmapped)
+      free(itemwidth);
+    itemwidth = w;
+    nwidths = n;
+    widthsmapped = widthsall = 0;
+  }
+  if (itemwidth[i] == WIDTHUNKNOWN)
+    itemwidth[i] =
+        MIN(drw_fontset_getwidth(drw, ITEMTEXT(i)), WIDTHUNKNOWN - 1);
+  return itemwidth[i];
+}
+
+/* the width of item i with padding, at most n */
+static unsigned int itemw_clamp(unsigned int i, unsigned int n) {
+  return MIN(itemw(i) + lrpad, n);
 }
 
 static int str_compar(const void *s0_in, const void *s1_in) {
   const char *s0 = *(const char **)s0_in;
   const char *s1 = *(const char **)s1_in;
-  return fstrncmp == strncasecmp ? strcasecmp(s0, s1) : strcmp(s0, s1);
+  return casefold ? strcasecmp(s0, s1) : strcmp(s0, s1);
 }
 
 static void parse_hpitems(char *src) {
@@ -132,18 +381,6 @@ static void parse_hpitems(char *src) {
   }
 }
 
-static void appenditem(struct item *item, struct item **list,
-                       struct item **last) {
-  if (*last)
-    (*last)->right = item;
-  else
-    *list = item;
-
-  item->left = *last;
-  item->right = NULL;
-  *last = item;
-}
-
 static void calcoffsets(void) {
   int i, n;
 
@@ -156,186 +393,319 @@ static void calcoffsets(void) {
   else
     n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">") + TEXTW(numbers));
   /* calculate which items will begin the next page and previous page */
-  for (i = 0, next = curr; next; next = next->right)
-    if ((i += (lines > 0) ? bh : textw_clamp(next->text, n)) > n)
+  for (i = 0, next = curr; next < nmatches; next++) {
+    if (next == nranked && nranked < nrankable) {
+      /* the page reaches the unsorted fuzzy matches */
+      rankrest();
+      i = 0;
+      next = curr;
+    }
+    if ((i += (lines > 0) ? bh : itemw_clamp(matchlist[next], n)) > n)
       break;
-  for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-    if ((i += (lines > 0) ? bh : textw_clamp(prev->left->text, n)) > n)
+  }
+  for (i = 0, prev = curr; prev > 0; prev--)
+    if ((i += (lines > 0) ? bh : itemw_clamp(matchlist[prev - 1], n)) > n)
       break;
 }
 
-static int max_textw(void) {
-  int len = 0;
-  for (struct item *item = items; item && item->text; item++)
-    len = MAX(TEXTW(item->text), len);
-  return len;
+/* the width of the widest item with padding; unless a -cache snapshot holds
+ * every width, see snapwidths(), or the items are few, it is estimated from
+ * the ESTITEMS items longest in bytes and measurewidths() finds the exact one
+ * while the menu is shown */
+static int widestitem(void) {
+  size_t len[ESTITEMS], l, i, j, n = 0;
+  unsigned int idx[ESTITEMS];
+  int w = 0;
+
+  if (widthsall || nitems < widthmin) {
+    for (i = 0; i < nitems; i++)
+      w = MAX(itemw(i) + lrpad, w);
+    fit.next = nitems;
+    snapwidths();
+    return fit.max = w;
+  }
+  /* the longest items so far, longest first */
+  for (i = 0; i < nitems; i++) {
+    l = strlen(ITEMTEXT(i));
+    if (n == ESTITEMS && l <= len[n - 1])
+      continue;
+    if (n < ESTITEMS)
+      n++;
+    for (j = n - 1; j > 0 && len[j - 1] < l; j--) {
+      len[j] = len[j - 1];
+      idx[j] = idx[j - 1];
+    }
+    len[j] = l;
+    idx[j] = i;
+  }
+  for (j = 0; j < n; j++)
+    w = MAX(itemw(idx[j]) + lrpad, w);
+  fit.next = fit.max = 0;
+  return w;
+}
+
+/* the width of a centered menu for items textw wide */
+static int centerw(int textw) {
+  return MIN(MAX(textw + promptw, min_width), fit.w);
 }
 
 static void cleanup(void) {
   size_t i;
 
   XUngrabKey(dpy, AnyKey, AnyModifier, root);
+  bgstop();
+  tristop();
   for (i = 0; i < SchemeLast; i++)
     free(scheme[i]);
-  for (i = 0; items && items[i].text; ++i)
-    free(items[i].text);
-  free(items);
+  if (prov.in >= 0)
+    close(prov.in);
+  free(prov.buf);
+  if (hist.slots)
+    munmap(hist.map, hist.size);
+  if (hist.fd >= 0)
+    close(hist.fd);
+  freeinput();
+  if (!itemsmapped) {
+    free(itemoff);
+    free(itemmask);
+    free(itemflags);
+  }
+  free(itemhist);
+  free(matchlist);
   free(hpitems);
   drw_free(drw);
   XSync(dpy, False);
   XCloseDisplay(dpy);
 }
 
-static char *cistrstr(const char *h, const char *n) {
-  size_t i;
+/* the text to print for item i, which -B may set apart from the one shown */
+static const char *itemvalue(unsigned int i) {
+  const char *s = ITEMTEXT(i);
 
-  if (!n[0])
-    return (char *)h;
+  return itemflags[i] & ItemValue ? s + strlen(s) + 1 : s;
+}
 
-  for (; *h; ++h) {
-    for (i = 0;
-         n[i] && tolower((unsigned char)n[i]) == tolower((unsigned char)h[i]);
-         ++i)
-      ;
-    if (n[i] == '\0')
-      return (char *)h;
-  }
-  return NULL;
+/* the index -ix prints for item i, its position in the input unless -B set
+ * one */
+static unsigned int itemindex(unsigned int i) {
+  uint32_t index;
+
+  if (!(itemflags[i] & ItemIndex))
+    return i;
+  memcpy(&index, ITEMTEXT(i) - sizeof index, sizeof index);
+  return index;
 }
 
-static int drawitem(struct item *item, int x, int y, int w) {
-  if (item == sel)
-    drw_setscheme(drw, scheme[SchemeSel]);
-  else if (item->hp)
-    drw_setscheme(drw, scheme[SchemeHp]);
-  else if (item->out)
-    drw_setscheme(drw, scheme[SchemeOut]);
-  else
-    drw_setscheme(drw, scheme[SchemeNorm]);
+/* prints s terminated like the input items */
+static void printitem(const char *s) {
+  fputs(s, stdout);
+  putchar(delim);
+}
+
+/* the color scheme of the match at position pos */
+static int itemscheme(size_t pos) {
+  unsigned int i = matchlist[pos];
+
+  if (pos == sel)
+    return SchemeSel;
+  else if (itemflags[i] & ItemHp)
+    return SchemeHp;
+  else if (itemflags[i] & ItemOut)
+    return SchemeOut;
+  return SchemeNorm;
+}
 
-  return drw_text(drw, x, y, w, bh, lrpad / 2, item->text, 0);
+/* draws the match at position pos */
+static int drawitem(size_t pos, int x, int y, int w) {
+  drw_setscheme(drw, scheme[itemscheme(pos)]);
+  return drw_text(drw, x, y, w, bh, lrpad / 2, ITEMTEXT(matchlist[pos]), 0);
 }
 
 static void recalculatenumbers() {
-  unsigned int numer = 0, denom = 0;
-  struct item *item;
-  if (matchend) {
-    numer++;
-    for (item = matchend; item && item->left; item = item->left)
-      numer++;
+  /* the total keeps growing while stdin is streamed */
+  snprintf(numbers, NUMBERSBUFSIZE, streaming ? "%zu/%zu+" : "%zu/%zu",
+           nmatches, nitems);
+}
+
+/* FNV-1a of n bytes at p, continuing from h */
+static uint64_t framehash(uint64_t h, const void *p, size_t n) {
+  const unsigned char *b = p;
+
+  while (n--)
+    h = (h ^ *b++) * 1099511628211ULL;
+  return h;
+}
+
+/* what the top line of a vertical list shows */
+static uint64_t topkey(void) {
+  uint64_t h = 14695981039346656037ULL;
+
+  h = framehash(h, prompt ? prompt : "", prompt ? strlen(prompt) + 1 : 1);
+  h = framehash(h, text, strlen(text) + 1);
+  h = framehash(h, &cursor, sizeof cursor);
+  return framehash(h, numbers, strlen(numbers) + 1);
+}
+
+/* what the row of the match at position pos shows, never 0 */
+static uint64_t rowkey(size_t pos) {
+  uint64_t h = 14695981039346656037ULL;
+  int s = itemscheme(pos);
+
+  h = framehash(h, &matchlist[pos], sizeof matchlist[pos]);
+  h = framehash(h, &s, sizeof s);
+  h = framehash(h, ITEMTEXT(matchlist[pos]), strlen(ITEMTEXT(matchlist[pos])));
+  return h ? h : 1;
+}
+
+/* adds the lines [y, y + h) to the damage, copying the damage so far to the
+ * window first unless they adjoin it */
+static void damage(int y, int h) {
+  if (frame.y1 != y) {
+    if (frame.y1 > frame.y0)
+      drw_map(drw, win, 0, frame.y0, mw, frame.y1 - frame.y0);
+    frame.y0 = y;
+  }
+  frame.y1 = y + h;
+}
+
+static void drawnumbers(void) {
+  drw_setscheme(drw, scheme[SchemeNorm]);
+  if (centered) {
+    drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), bh, lrpad / 2,
+             numbers, 0);
+  } else {
+    drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), promptheight,
+             lrpad / 2, numbers, 0);
   }
-  for (item = items; item && item->text; item++)
-    denom++;
-  snprintf(numbers, NUMBERSBUFSIZE, "%d/%d", numer, denom);
 }
 
+/* draws the menu; a vertical list repaints and copies to the window only the
+ * top line and the rows that differ from the last frame */
 static void drawmenu(void) {
-  unsigned int curpos;
-  struct item *item;
-  int x = 0, y = 0, fh = drw->fonts->h, w = 0;
+  unsigned int curpos, r;
+  size_t item;
+  int x = 0, y = 0, fh = drw->fonts->h, w = 0, full, rowx, roww;
+  int toph = centered ? bh : promptheight;
+  uint64_t key;
   char *censort;
 
-  drw_setscheme(drw, scheme[SchemeNorm]);
-  drw_rect(drw, 0, 0, mw, mh, 1, 1);
-
-  if (prompt && *prompt) {
-    drw_setscheme(drw, scheme[SchemeSel]);
-    if (centered) {
-      x = drw_text(drw, x, 0, !draw_input ? mw : promptw, bh, lrpad / 2, prompt,
-                   0);
-    } else {
-      x = drw_text(drw, x, 0, !draw_input ? mw : promptw, promptheight,
-                   lrpad / 2, prompt, 0);
-    }
+  drw_frame_begin(drw);
+  recalculatenumbers();
+  full = !frame.valid || lines <= 0 || frame.nrows != lines;
+  if (full && lines > 0 && frame.nrows != lines) {
+    frame.nrows = lines;
+    if (!(frame.rows = realloc(frame.rows, lines * sizeof *frame.rows)))
+      die("cannot realloc %zu bytes:", lines * sizeof *frame.rows);
   }
-  /* draw input field */
-  if (draw_input) {
-    w = (lines > 0 || !matches) ? mw - x : inputw;
+  frame.y0 = frame.y1 = 0;
+  if (full) {
     drw_setscheme(drw, scheme[SchemeNorm]);
-    if (centered) {
-      if (passwd) {
-        censort = ecalloc(1, sizeof(text));
-        memset(censort, '.', strlen(text));
-        drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
-        free(censort);
-      } else
-        drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
-    } else {
-      if (passwd) {
-        censort = ecalloc(1, sizeof(text));
-        memset(censort, '.', strlen(text));
-        drw_text(drw, x, 0, w, promptheight, lrpad / 2, censort, 0);
-        free(censort);
-      } else
-        drw_text(drw, x, 0, w, promptheight, lrpad / 2, text, 0);
-    }
+    drw_rect(drw, 0, 0, mw, mh, 1, 1);
+  }
 
-    curpos = TEXTW(text) - TEXTW(&text[cursor]);
-    if ((curpos += lrpad / 2 - 1) < w) {
+  if (prompt && *prompt)
+    x = !draw_input ? mw : promptw;
+  key = topkey();
+  if (full || key != frame.top) {
+    if (!full) {
+      drw_setscheme(drw, scheme[SchemeNorm]);
+      drw_rect(drw, 0, 0, mw, toph, 1, 1);
+    }
+    if (prompt && *prompt) {
+      drw_setscheme(drw, scheme[SchemeSel]);
+      if (centered) {
+        drw_text(drw, 0, 0, !draw_input ? mw : promptw, bh, lrpad / 2, prompt,
+                 0);
+      } else {
+        drw_text(drw, 0, 0, !draw_input ? mw : promptw, promptheight,
+                 lrpad / 2, prompt, 0);
+      }
+    }
+    /* draw input field */
+    if (draw_input) {
+      w = (lines > 0 || !nmatches) ? mw - x : inputw;
       drw_setscheme(drw, scheme[SchemeNorm]);
       if (centered) {
-        drw_rect(drw, x + curpos, 2 + (bh - fh) / 2, 2, fh - 4, 1, 0);
+        if (passwd) {
+          censort = ecalloc(1, sizeof(text));
+          memset(censort, '.', strlen(text));
+          drw_text(drw, x, 0, w, bh, lrpad / 2, censort, 0);
+          free(censort);
+        } else
+          drw_text(drw, x, 0, w, bh, lrpad / 2, text, 0);
       } else {
-        drw_rect(drw, x + curpos, 2 + (promptheight - fh) / 2, 2, fh - 4, 1, 0);
+        if (passwd) {
+          censort = ecalloc(1, sizeof(text));
+          memset(censort, '.', strlen(text));
+          drw_text(drw, x, 0, w, promptheight, lrpad / 2, censort, 0);
+          free(censort);
+        } else
+          drw_text(drw, x, 0, w, promptheight, lrpad / 2, text, 0);
+      }
+
+      curpos = TEXTW(text) - TEXTW(&text[cursor]);
+      if ((curpos += lrpad / 2 - 1) < w) {
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        if (centered) {
+          drw_rect(drw, x + curpos, 2 + (bh - fh) / 2, 2, fh - 4, 1, 0);
+        } else {
+          drw_rect(drw, x + curpos, 2 + (promptheight - fh) / 2, 2, fh - 4, 1,
+                   0);
+        }
       }
     }
+    if (lines > 0)
+      drawnumbers();
+    frame.top = key;
+    damage(0, toph);
   }
 
-  recalculatenumbers();
   if (lines > 0) {
-    _Bool ispromptsize = True;
     /* draw vertical list */
-    for (item = curr; item != next; item = item->right) {
-      if (!centered) {
-        if (ispromptsize) {
-          if (draw_input) {
-            drawitem(item, x, y = promptheight, mw - x);
-          } else {
-            drawitem(item,
-                     (!draw_input && prompt && *prompt) ? x - mw : x - promptw,
-                     y = promptheight, mw);
-
-          }
-          ispromptsize = False;
-          continue;
-        }
-      }
-      if (draw_input) {
-        drawitem(item, x, y += bh, mw - x);
-      } else {
-        drawitem(item,
-                 (!draw_input && prompt && *prompt) ? x - mw : x - promptw,
-                 y += bh, mw);
+    rowx = draw_input ? x : (prompt && *prompt) ? x - mw : x - promptw;
+    roww = draw_input ? mw - x : mw;
+    for (r = 0; r < lines; r++) {
+      item = curr + r;
+      key = item < next ? rowkey(item) : 0;
+      if (!full && key == frame.rows[r])
+        continue;
+      y = toph + r * bh;
+      if (item < next) {
+        drawitem(item, rowx, y, roww);
+      } else if (!full) {
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        drw_rect(drw, 0, y, mw, bh, 1, 1);
       }
+      frame.rows[r] = key;
+      damage(y, bh);
     }
-  } else if (matches) {
+  } else if (nmatches) {
     /* draw horizontal list */
     x += inputw;
     w = TEXTW("<");
-    if (curr->left) {
+    if (curr > 0) {
       drw_setscheme(drw, scheme[SchemeNorm]);
       drw_text(drw, x, 0, w, bh, lrpad / 2, "<", 0);
       x += w;
     }
-    for (item = curr; item != next; item = item->right)
-      x = drawitem(
-          item, x, 0,
-          textw_clamp(item->text, mw - x - TEXTW(">") - TEXTW(numbers)));
-    if (next) {
+    for (item = curr; item < next; item++)
+      x = drawitem(item, x, 0,
+                   itemw_clamp(matchlist[item],
+                               mw - x - TEXTW(">") - TEXTW(numbers)));
+    if (next < nmatches) {
       w = TEXTW(">");
       drw_setscheme(drw, scheme[SchemeNorm]);
       drw_text(drw, mw - w - TEXTW(numbers), 0, w, bh, lrpad / 2, ">", 0);
     }
   }
-  drw_setscheme(drw, scheme[SchemeNorm]);
-  if (centered) {
-    drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), bh, lrpad / 2,
-             numbers, 0);
-  } else {
-    drw_text(drw, mw - TEXTW(numbers), 0, TEXTW(numbers), promptheight,
-             lrpad / 2, numbers, 0);
-  }
-  drw_map(drw, win, 0, 0, mw, mh);
+  if (lines <= 0)
+    drawnumbers();
+  drw_frame_end(drw);
+  if (full)
+    drw_map(drw, win, 0, 0, mw, mh);
+  else if (frame.y1 > frame.y0)
+    drw_map(drw, win, 0, frame.y0, mw, frame.y1 - frame.y0);
+  frame.valid = 1;
 }
 
 static void grabfocus(void) {
@@ -370,86 +740,1057 @@ static void grabkeyboard(void) {
 }
 
 int compare_distance(const void *a, const void *b) {
-  struct item *da = *(struct item **)a;
-  struct item *db = *(struct item **)b;
-
-  if (!db)
-    return 1;
-  if (!da)
-    return -1;
+  const struct rank *da = a;
+  const struct rank *db = b;
 
-  return da->distance == db->distance  ? 0
+  return da->distance == db->distance
+             ? (da->item > db->item) - (da->item < db->item)
          : da->distance < db->distance ? -1
                                        : 1;
 }
 
-void fuzzymatch(void) {
-  /* bang - we have so much memory */
-  struct item *it;
-  struct item **fuzzymatches = NULL;
+/* same order as compare_distance, ties are broken by item order */
+#define RANKBEFORE(a, b)                                                       \
+  ((a).distance < (b).distance ||                                              \
+   ((a).distance == (b).distance && (a).item < (b).item))
+
+static void ranksift(struct rank *v, size_t i, size_t n) {
+  size_t c;
+  struct rank t;
+
+  for (; (c = 2 * i + 1) < n; i = c) {
+    if (c + 1 < n && RANKBEFORE(v[c], v[c + 1]))
+      c++;
+    if (!RANKBEFORE(v[i], v[c]))
+      break;
+    t = v[i];
+    v[i] = v[c];
+    v[c] = t;
+  }
+}
+
+/* move the best k of the n matches to the front of v in sorted order, the
+ * others stay behind them unsorted */
+static void rankfront(struct rank *v, size_t n, size_t k) {
+  size_t i;
+  struct rank t;
+
+  /* heap of the best k seen so far, the worst of them on top */
+  for (i = k / 2; i-- > 0;)
+    ranksift(v, i, k);
+  for (i = k; i < n; i++) {
+    if (RANKBEFORE(v[i], v[0])) {
+      t = v[0];
+      v[0] = v[i];
+      v[i] = t;
+      ranksift(v, 0, k);
+    }
+  }
+  qsort(v, k, sizeof *v, compare_distance);
+}
+
+/* sort and list the matches that were left behind the first fuzzytop */
+static void rankrest(void) {
+  size_t i;
+
+  if (nranked >= nrankable)
+    return;
+  qsort(&ranked[nranked], nrankable - nranked, sizeof *ranked,
+        compare_distance);
+  for (i = nranked; i < nrankable; i++)
+    matchlist[i] = ranked[i].item;
+  nranked = nrankable;
+}
+
+/* grow the match buffers so that they can hold every item, and decide whether
+ * the previous filter result may be narrowed for the current query */
+static void prepmatchset(void) {
+  histitems();
+  if (matchsetsiz < nitems) {
+    matchsetsiz = nitems;
+    if (!(matchset = realloc(matchset, matchsetsiz * sizeof *matchset)) ||
+        !(matchnext = realloc(matchnext, matchsetsiz * sizeof *matchnext)) ||
+        !(matchtier = realloc(matchtier, matchsetsiz * sizeof *matchtier)))
+      die("cannot realloc %zu bytes:", matchsetsiz * sizeof *matchset);
+    /* only fuzzy matching measures distances */
+    if (fuzzy &&
+        !(matchdist = realloc(matchdist, matchsetsiz * sizeof *matchdist)))
+      die("cannot realloc %zu bytes:", matchsetsiz * sizeof *matchdist);
+  }
+  if (matchsetvalid && !strncmp(query, matchsettext, strlen(matchsettext))) {
+    matchsrc = matchset;
+    matchsrclen = matchsetlen;
+  } else {
+    matchsrc = NULL;
+    matchsrclen = nitems;
+  }
+}
+
+/* whether a newer query made the current pass pointless */
+static int matchcancelled(void) {
+  int c;
+
+  if (!bg.started)
+    return 0;
+  pthread_mutex_lock(&bg.lock);
+  c = bg.want != passgen;
+  pthread_mutex_unlock(&bg.lock);
+  return c;
+}
+
+/* FNV-1a hash of s, never 0 which marks an empty slot */
+static uint64_t histhash(const char *s) {
+  uint64_t h = 14695981039346656037ULL;
+
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return h ? h : 1;
+}
+
+/* how often a slot was chosen, weighted by how long ago */
+static double histvalue(const struct histslot *e) {
+  uint32_t age = hist.now > e->last ? hist.now - e->last : 0;
+
+  return e->count * (age < 4 * 86400    ? 1.0
+                     : age < 14 * 86400 ? 0.7
+                     : age < 31 * 86400 ? 0.5
+                     : age < 90 * 86400 ? 0.3
+                                        : 0.1);
+}
+
+/* hashes the values of the items added since, before a match pass looks them
+ * up */
+static void histitems(void) {
+  if (!hist.slots || nhashed == nitems)
+    return;
+  if (nitems > histsiz) {
+    histsiz = MAX(nitems, 2 * histsiz);
+    if (!(itemhist = realloc(itemhist, histsiz * sizeof *itemhist)))
+      die("cannot realloc %zu bytes:", histsiz * sizeof *itemhist);
+  }
+  for (; nhashed < nitems; nhashed++)
+    itemhist[nhashed] = histhash(itemvalue(nhashed));
+}
+
+/* the frecency of item i, 0 if it was never chosen */
+static double histscore(unsigned int i) {
+  uint64_t h;
+  uint32_t j, k;
+
+  if (!hist.slots)
+    return 0;
+  h = i < nhashed ? itemhist[i] : histhash(itemvalue(i));
+  for (j = h & hist.mask, k = 0; k < HISTPROBE; j = (j + 1) & hist.mask, k++)
+    if (hist.slots[j].hash == h)
+      return histvalue(&hist.slots[j]);
+    else if (!hist.slots[j].hash)
+      break;
+  return 0;
+}
+
+/* maps the history file, creating it with histslots slots if it is missing
+ * or unusable; without it no history is kept */
+static void histopen(void) {
+  struct histhdr h;
+  struct stat st;
+  char path[PATH_MAX], *p;
+  const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  size_t size;
+  void *map;
+  int n, valid;
+
+  if (dir && *dir)
+    n = snprintf(path, sizeof path, "%s/dmenu/history", dir);
+  else if (home && *home)
+    n = snprintf(path, sizeof path, "%s/.cache/dmenu/history", home);
+  else
+    return;
+  if (n < 0 || (size_t)n >= sizeof path || !histslots ||
+      histslots & (histslots - 1))
+    return;
+  for (p = path + 1; (p = strchr(p, '/')); *p++ = '/') {
+    *p = '\0';
+    mkdir(path, 0700);
+  }
+  if ((hist.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    return;
+  flock(hist.fd, LOCK_EX);
+  if (fstat(hist.fd, &st))
+    goto fail;
+  valid = pread(hist.fd, &h, sizeof h, 0) == sizeof h &&
+          !memcmp(h.magic, HISTMAGIC, sizeof h.magic) &&
+          h.version == HISTVERSION && h.nslots &&
+          !(h.nslots & (h.nslots - 1)) &&
+          (uint64_t)st.st_size == sizeof h + (uint64_t)h.nslots * sizeof
+          *hist.slots;
+  if (!valid) {
+    /* an unusable file is started afresh */
+    memcpy(h.magic, HISTMAGIC, sizeof h.magic);
+    h.version = HISTVERSION;
+    h.nslots = histslots;
+    if (ftruncate(hist.fd, 0) ||
+        ftruncate(hist.fd, sizeof h + (size_t)h.nslots * sizeof *hist.slots) ||
+        pwrite(hist.fd, &h, sizeof h, 0) != sizeof h)
+      goto fail;
+  }
+  size = sizeof h + (size_t)h.nslots * sizeof *hist.slots;
+  if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hist.fd,
+                  0)) == MAP_FAILED)
+    goto fail;
+  flock(hist.fd, LOCK_UN);
+  hist.map = map;
+  hist.slots = (struct histslot *)((char *)map + sizeof h);
+  hist.mask = h.nslots - 1;
+  hist.size = size;
+  hist.now = time(NULL);
+  return;
+fail:
+  close(hist.fd);
+  hist.fd = -1;
+}
+
+/* records that item i was chosen */
+static void histbump(unsigned int i) {
+  struct histslot *e, *victim = NULL;
+  uint64_t h;
+  uint32_t j, k;
+
+  if (!hist.slots)
+    return;
+  h = i < nhashed ? itemhist[i] : histhash(itemvalue(i));
+  flock(hist.fd, LOCK_EX);
+  for (j = h & hist.mask, k = 0; k < HISTPROBE; j = (j + 1) & hist.mask, k++) {
+    e = &hist.slots[j];
+    if (e->hash == h || !e->hash) {
+      victim = e;
+      break;
+    }
+    if (!victim || histvalue(e) < histvalue(victim))
+      victim = e;
+  }
+  if (victim->hash != h) {
+    victim->hash = h;
+    victim->count = 0;
+  }
+  if (victim->count < UINT32_MAX)
+    victim->count++;
+  victim->last = time(NULL);
+  flock(hist.fd, LOCK_UN);
+  /* the tiers of cached and narrowed matches are stale now */
+  matchsync();
+  cacheclear();
+  matchsetvalid = 0;
+}
+
+static int fuzzytier(unsigned int item, double *distance) {
+  const char *key = ITEMKEY(item);
   char c;
-  int number_of_matches = 0, i, pidx, sidx, eidx;
-  int text_len = strlen(text), itext_len;
-
-  matches = matchend = NULL;
-
-  /* walk through all items */
-  for (it = items; it && it->text; it++) {
-    if (text_len) {
-      itext_len = strlen(it->text);
-      pidx = 0;         /* pointer */
-      sidx = eidx = -1; /* start of match, end of match */
-      /* walk through item text */
-      for (i = 0; i < itext_len && (c = it->text[i]); i++) {
-        /* fuzzy match pattern */
-        if (!fstrncmp(&text[pidx], &c, 1)) {
-          if (sidx == -1)
-            sidx = i;
-          pidx++;
-          if (pidx == text_len) {
-            eidx = i;
-            break;
-          }
-        }
+  int i, pidx, sidx, eidx, itext_len;
+
+  /* without a query what was chosen before goes first */
+  if (!textlen)
+    return histscore(item) > 0 ? TierHist : TierPrefix;
+  itext_len = strlen(key);
+  pidx = 0;         /* pointer */
+  sidx = eidx = -1; /* start of match, end of match */
+  /* walk through item text */
+  for (i = 0; i < itext_len && (c = key[i]); i++) {
+    /* fuzzy match pattern */
+    if (query[pidx] == c) {
+      if (sidx == -1)
+        sidx = i;
+      pidx++;
+      if (pidx == textlen) {
+        eidx = i;
+        break;
       }
-      /* build list of matches */
-      if (eidx != -1) {
-        /* compute distance */
-        /* add penalty if match starts late (log(sidx+2))
-         * add penalty for long a match without many matching characters */
-        it->distance = log(sidx + 2) + (double)(eidx - sidx - text_len);
-        /* fprintf(stderr, "distance %s %f\n", it->text, it->distance); */
-        appenditem(it, &matches, &matchend);
-        number_of_matches++;
+    }
+  }
+  if (eidx == -1)
+    return -1;
+  /* compute distance */
+  /* add penalty if match starts late (log(sidx+2))
+   * add penalty for long a match without many matching characters */
+  *distance = log(sidx + 2) + (double)(eidx - sidx - textlen);
+  /* and a bonus for items chosen often and lately */
+  if (hist.slots)
+    *distance -= log1p(histscore(item));
+  /* fprintf(stderr, "distance %s %f\n", ITEMTEXT(item), *distance); */
+  return TierExact;
+}
+
+static int tokentier(unsigned int item) {
+  const char *key = ITEMKEY(item);
+  int i;
+
+  for (i = 0; i < tokc; i++)
+    if (!searchstr(key, tokv[i]))
+      return -1; /* not all tokens match */
+  /* exact matches go first, then what was chosen before, then prefixes with
+   * high priority, then prefixes, then substrings */
+  if (tokc && !strncmp(query, key, textsize))
+    return TierExact;
+  if (histscore(item) > 0)
+    return TierHist;
+  if (!tokc)
+    return TierPrefix;
+  if (!strncmp(tokv[0], key, toklen))
+    return itemflags[item] & ItemHp ? TierHpPrefix : TierPrefix;
+  return TierSubstr;
+}
+
+static void filterchunk(struct matchchunk *c) {
+  size_t j;
+  unsigned int idx;
+  int t;
+
+  memset(c->ntier, 0, sizeof c->ntier);
+  c->cancelled = 0;
+  for (c->len = 0, j = c->lo; j < c->hi; j++) {
+    if (!((j - c->lo + 1) % 4096) && matchcancelled()) {
+      c->cancelled = 1;
+      return;
+    }
+    idx = matchsrc ? matchsrc[j] : j;
+    /* skip items lacking a byte of the query without reading their text */
+    if ((itemmask[idx] & textmask) != textmask)
+      continue;
+    if ((t = fuzzy ? fuzzytier(idx, &matchdist[c->lo + c->len])
+                   : tokentier(idx)) < 0)
+      continue;
+    /* the kept matches never overtake the source position j, so matchsrc
+     * may be matchnext itself */
+    matchnext[c->lo + c->len] = idx;
+    matchtier[c->lo + c->len++] = t;
+    c->ntier[t]++;
+  }
+}
+
+static void *poolworker(void *arg) {
+  size_t c;
+
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.next >= pool.nchunks)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    c = pool.next++;
+    pthread_mutex_unlock(&pool.lock);
+    filterchunk(&pool.chunks[c]);
+    pthread_mutex_lock(&pool.lock);
+    if (++pool.finished == pool.nchunks)
+      pthread_cond_signal(&pool.done);
+  }
+  return NULL;
+}
+
+/* returns the number of chunks to split n items into, starting the worker
+ * threads on first use; small inputs stay on the calling thread */
+static size_t poolchunks(size_t n) {
+  long ncpu;
+  unsigned int nthreads = threads;
+  pthread_t t;
+
+  if (!nthreads)
+    nthreads = (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? ncpu : 1;
+  if (nthreads <= 1 || n < threadmin)
+    return 1;
+  for (; pool.nthreads < nthreads - 1; pool.nthreads++)
+    if (pthread_create(&t, NULL, poolworker, NULL))
+      break;
+  return pool.nthreads ? (pool.nthreads + 1) * 4 : 1;
+}
+
+static void poolrun(struct matchchunk *chunks, size_t nchunks) {
+  size_t c;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.chunks = chunks;
+  pool.nchunks = nchunks;
+  pool.next = pool.finished = 0;
+  pthread_cond_broadcast(&pool.work);
+  /* the calling thread takes its share of chunks as well */
+  while (pool.next < pool.nchunks) {
+    c = pool.next++;
+    pthread_mutex_unlock(&pool.lock);
+    filterchunk(&chunks[c]);
+    pthread_mutex_lock(&pool.lock);
+    pool.finished++;
+  }
+  while (pool.finished < pool.nchunks)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pool.nchunks = pool.next = 0;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+static unsigned int trihash(const char *s) {
+  const unsigned char *u = (const unsigned char *)s;
+
+  return ((u[0] << 16 | u[1] << 8 | u[2]) * 2654435761U) >> (32 - TRIBITS);
+}
+
+static int tricancelled(void) {
+  int c;
+
+  pthread_mutex_lock(&tri.lock);
+  c = tri.cancel;
+  pthread_mutex_unlock(&tri.lock);
+  return c;
+}
+
+/* builds the posting lists of the case-folded trigrams of all items, in two
+ * passes over the text: the first counts, the second fills */
+static void *tribuild(void *arg) {
+  size_t i, j, len, bufsiz = 0, *start, *fill;
+  unsigned int b, *post = NULL, *last;
+  char *buf = NULL;
+  int pass;
+
+  start = ecalloc(TRIBUCKETS + 1, sizeof *start);
+  fill = ecalloc(TRIBUCKETS, sizeof *fill);
+  last = ecalloc(TRIBUCKETS, sizeof *last);
+  for (pass = 0; pass < 2; pass++) {
+    /* last[b] is 1 + the last item added to bucket b */
+    memset(last, 0, TRIBUCKETS * sizeof *last);
+    for (i = 0; i < nitems; i++) {
+      if (!(i % 4096) && tricancelled())
+        goto out;
+      if ((len = strlen(ITEMTEXT(i))) > bufsiz &&
+          !(buf = realloc(buf, (bufsiz = len))))
+        die("cannot realloc %zu bytes:", bufsiz);
+      searchfold(buf, ITEMTEXT(i), len);
+      for (j = 0; j + 3 <= len; j++) {
+        if (last[b = trihash(&buf[j])] == i + 1)
+          continue;
+        last[b] = i + 1;
+        if (pass)
+          post[fill[b]++] = i;
+        else
+          start[b + 1]++;
       }
-    } else {
-      appenditem(it, &matches, &matchend);
     }
+    if (!pass) {
+      for (b = 0; b < TRIBUCKETS; b++)
+        start[b + 1] += start[b];
+      memcpy(fill, start, TRIBUCKETS * sizeof *fill);
+      if (!(post = malloc(start[TRIBUCKETS] * sizeof *post)))
+        die("cannot malloc %zu bytes:", start[TRIBUCKETS] * sizeof *post);
+    }
+  }
+  if (stats)
+    fprintf(stderr, "dmenu: trigram index of %zu items: %zu KiB\n", nitems,
+            ((TRIBUCKETS + 1) * sizeof *start +
+             start[TRIBUCKETS] * sizeof *post) / 1024);
+  pthread_mutex_lock(&tri.lock);
+  tri.start = start;
+  tri.post = post;
+  start = NULL;
+  post = NULL;
+  pthread_mutex_unlock(&tri.lock);
+out:
+  free(start);
+  free(post);
+  free(fill);
+  free(last);
+  free(buf);
+  return NULL;
+}
+
+static void tristart(void) {
+  if (tri.started || fuzzy || dynamic || provider || !trigrammin ||
+      nitems < trigrammin)
+    return;
+  if (pthread_create(&tri.thread, NULL, tribuild, NULL))
+    return;
+  tri.started = 1;
+}
+
+static void tristop(void) {
+  if (!tri.started)
+    return;
+  pthread_mutex_lock(&tri.lock);
+  tri.cancel = 1;
+  pthread_mutex_unlock(&tri.lock);
+  pthread_join(tri.thread, NULL);
+  tri.started = 0;
+}
+
+/* index of the first b[i] >= x in b[j, m), galloping from j */
+static size_t lowerbound(const unsigned int *b, size_t j, size_t m,
+                         unsigned int x) {
+  size_t step, hi, mid;
+
+  for (step = 1; j + step < m && b[j + step] < x; step <<= 1)
+    j += step;
+  for (hi = MIN(j + step, m); j < hi;) {
+    mid = j + (hi - j) / 2;
+    if (b[mid] < x)
+      j = mid + 1;
+    else
+      hi = mid;
+  }
+  return j;
+}
+
+/* replace the filter source by the items the trigram index lists for every
+ * token of three or more bytes, when that is fewer than the source */
+static void tricandidates(void) {
+  unsigned int buckets[sizeof query], b, *post, *p;
+  size_t *start, nb = 0, len, i, j, k, n, m, best = 0;
+  char buf[sizeof query];
+  int t;
+
+  pthread_mutex_lock(&tri.lock);
+  start = tri.start;
+  post = tri.post;
+  pthread_mutex_unlock(&tri.lock);
+  if (!start)
+    return;
+  for (t = 0; t < tokc; t++) {
+    searchfold(buf, tokv[t], (len = strlen(tokv[t])));
+    for (i = 0; i + 3 <= len; i++) {
+      b = trihash(&buf[i]);
+      for (j = 0; j < nb && buckets[j] != b; j++)
+        ;
+      if (j == nb)
+        buckets[nb++] = b;
+      if (start[b + 1] - start[b] <
+          start[buckets[best] + 1] - start[buckets[best]])
+        best = j;
+    }
+  }
+  if (!nb)
+    return;
+  n = start[buckets[best] + 1] - start[buckets[best]];
+  if (matchsrc && matchsrclen <= n)
+    return;
+  memcpy(matchnext, &post[start[buckets[best]]], n * sizeof *matchnext);
+  for (j = 0; j < nb && n; j++) {
+    if (j == best)
+      continue;
+    p = &post[start[buckets[j]]];
+    m = start[buckets[j] + 1] - start[buckets[j]];
+    for (i = k = len = 0; i < n; i++) {
+      if ((k = lowerbound(p, k, m, matchnext[i])) == m)
+        break;
+      if (p[k] == matchnext[i])
+        matchnext[len++] = matchnext[i];
+    }
+    n = len;
+  }
+  matchsrc = matchnext;
+  matchsrclen = n;
+}
+
+static int cachemode(void) { return fuzzy | casefold << 1; }
+
+static void cachedrop(size_t i) {
+  free(cache.e[i].text);
+  free(cache.e[i].set);
+  free(cache.e[i].aux);
+  cache.bytes -= cache.e[i].bytes;
+  memset(&cache.e[i], 0, sizeof cache.e[i]);
+}
+
+static void cacheclear(void) {
+  size_t i;
+
+  for (i = 0; i < LENGTH(cache.e); i++)
+    cachedrop(i);
+}
+
+/* restore the filter result of an earlier identical query */
+static int cacheget(void) {
+  size_t i;
+  int mode = cachemode();
+
+  for (i = 0; i < LENGTH(cache.e); i++)
+    if (cache.e[i].text && cache.e[i].mode == mode &&
+        !strcmp(cache.e[i].text, query))
+      break;
+  if (i == LENGTH(cache.e))
+    return 0;
+  matchsetlen = cache.e[i].len;
+  memcpy(matchset, cache.e[i].set, matchsetlen * sizeof *matchset);
+  memcpy(ntier, cache.e[i].ntier, sizeof ntier);
+  if (fuzzy && *query) {
+    memset(matchtier, TierExact, matchsetlen);
+    if (cache.e[i].aux)
+      memcpy(matchdist, cache.e[i].aux, matchsetlen * sizeof *matchdist);
+  } else {
+    memcpy(matchtier, cache.e[i].aux, matchsetlen * sizeof *matchtier);
+  }
+  cache.e[i].used = ++cache.clock;
+  strcpy(matchsettext, query);
+  matchsetvalid = 1;
+  return 1;
+}
+
+/* remember the filter result in matchset, evicting the least recently used
+ * results to stay within matchcache bytes */
+static void cacheput(void) {
+  size_t i, empty, lru, auxsize, bytes;
+
+  auxsize = fuzzy && textlen ? sizeof *matchdist : sizeof *matchtier;
+  bytes = matchsetlen * (sizeof *matchset + auxsize) + strlen(query) + 1;
+  if (bytes > matchcache)
+    return;
+  for (;;) {
+    for (i = empty = lru = LENGTH(cache.e); i-- > 0;)
+      if (!cache.e[i].text)
+        empty = i;
+      else if (lru == LENGTH(cache.e) || cache.e[i].used < cache.e[lru].used)
+        lru = i;
+    if (empty < LENGTH(cache.e) && cache.bytes + bytes <= matchcache)
+      break;
+    cachedrop(lru);
+  }
+  i = empty;
+  cache.e[i].text = strdup(query);
+  cache.e[i].set = malloc(matchsetlen * sizeof *matchset);
+  cache.e[i].aux = malloc(matchsetlen * auxsize);
+  if (!cache.e[i].text || (matchsetlen && !cache.e[i].set) ||
+      (matchsetlen && !cache.e[i].aux)) {
+    cachedrop(i);
+    return;
   }
+  memcpy(cache.e[i].set, matchset, matchsetlen * sizeof *matchset);
+  memcpy(cache.e[i].aux, fuzzy && textlen ? (void *)matchdist : (void *)matchtier,
+         matchsetlen * auxsize);
+  memcpy(cache.e[i].ntier, ntier, sizeof ntier);
+  cache.e[i].mode = cachemode();
+  cache.e[i].len = matchsetlen;
+  cache.e[i].bytes = bytes;
+  cache.e[i].used = ++cache.clock;
+  cache.bytes += bytes;
+}
+
+/* filter the items, or only the previous matches while the query grows, into
+ * matchset and tag every match with its tier in matchtier, returns 0 when the
+ * pass was cancelled */
+static int filteritems(void) {
+  static struct matchchunk *chunks = NULL;
+  static size_t chunksiz = 0;
+  size_t i, n, nchunks, len;
+  unsigned int *swap;
+  int t;
+
+  prepmatchset();
+  if (cacheget())
+    return 1;
+  if (!fuzzy)
+    tricandidates();
+  n = matchsrclen;
+  if ((nchunks = poolchunks(n)) > chunksiz) {
+    chunksiz = nchunks;
+    if (!(chunks = realloc(chunks, chunksiz * sizeof *chunks)))
+      die("cannot realloc %zu bytes:", chunksiz * sizeof *chunks);
+  }
+  for (i = 0; i < nchunks; i++) {
+    chunks[i].lo = n * i / nchunks;
+    chunks[i].hi = n * (i + 1) / nchunks;
+  }
+  if (nchunks == 1)
+    filterchunk(chunks);
+  else
+    poolrun(chunks, nchunks);
+  for (i = 0; i < nchunks; i++)
+    if (chunks[i].cancelled)
+      return 0;
+
+  /* move the per-chunk results next to each other, keeping their order */
+  memset(ntier, 0, sizeof ntier);
+  for (len = i = 0; i < nchunks; len += chunks[i++].len) {
+    memmove(&matchnext[len], &matchnext[chunks[i].lo],
+            chunks[i].len * sizeof *matchnext);
+    memmove(&matchtier[len], &matchtier[chunks[i].lo],
+            chunks[i].len * sizeof *matchtier);
+    if (fuzzy)
+      memmove(&matchdist[len], &matchdist[chunks[i].lo],
+              chunks[i].len * sizeof *matchdist);
+    for (t = 0; t < TierLast; t++)
+      ntier[t] += chunks[i].ntier[t];
+  }
+  swap = matchset;
+  matchset = matchnext;
+  matchnext = swap;
+  matchsetlen = len;
+  strcpy(matchsettext, query);
+  matchsetvalid = 1;
+  cacheput();
+  return 1;
+}
+
+/* makes room for n entries in matchlist, which only the main thread touches */
+static void growmatchlist(size_t n) {
+  if (n <= matchlistsiz)
+    return;
+  matchlistsiz = n;
+  if (!(matchlist = realloc(matchlist, matchlistsiz * sizeof *matchlist)))
+    die("cannot realloc %zu bytes:", matchlistsiz * sizeof *matchlist);
+}
+
+/* orders the n items at v by frecency, most valued first */
+static void sorthist(unsigned int *v, size_t n) {
+  struct rank *r = ecalloc(n, sizeof *r);
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    r[i].distance = -histscore(v[i]);
+    r[i].item = v[i];
+  }
+  qsort(r, n, sizeof *r, compare_distance);
+  for (i = 0; i < n; i++)
+    v[i] = r[i].item;
+  free(r);
+}
+
+/* list the filtered items tier by tier, in item order within each tier but
+ * the history one */
+static void linkmatches(size_t len) {
+  size_t i, n = 0;
+  int t;
+
+  growmatchlist(len);
+  for (t = 0; t < TierLast; t++)
+    for (i = 0; ntier[t] && i < len; i++)
+      if (matchtier[i] == t)
+        matchlist[n++] = matchset[i];
+  if (ntier[TierHist] > 1)
+    sorthist(&matchlist[ntier[TierExact]], ntier[TierHist]);
+  nmatches = n;
+  nranked = nrankable = 0;
+}
+
+static void rankmatches(void);
+
+/* ranks the fuzzy matches into rankbuf, returns 0 when cancelled */
+static int fuzzymatch(void) {
+  textlen = strlen(query);
+  textmask = searchmask(query);
+  if (!filteritems())
+    return 0;
+  if (textlen)
+    rankmatches();
+  return !matchcancelled();
+}
+
+/* rank the fuzzy matches in matchset into rankbuf */
+static void rankmatches(void) {
+  size_t i, n;
+
+  n = matchsetlen;
+  if (n > rankbufsiz) {
+    rankbufsiz = n;
+    if (!(rankbuf = realloc(rankbuf, rankbufsiz * sizeof *rankbuf)))
+      die("cannot realloc %zu bytes:", rankbufsiz * sizeof *rankbuf);
+  }
+  for (i = 0; i < n; i++) {
+    rankbuf[i].distance = matchdist[i];
+    rankbuf[i].item = matchset[i];
+  }
+  /* only the first screens are sorted according to distance, the rest
+   * once the user pages there */
+  krankbuf = fuzzytop && fuzzytop < n ? fuzzytop : n;
+  nrankbuf = n;
+  rankfront(rankbuf, n, krankbuf);
+}
+
+/* the query of the next pass, case-folded like the keys */
+static void setquery(const char *s) {
+  strcpy(query, s);
+  if (casefold)
+    searchfold(query, query, strlen(query));
+}
+
+/* runs the match pass for query, on the main thread or the background
+ * matcher; returns 0 when it was cancelled */
+static int computematch(void) {
+  char buf[sizeof query], *s;
+  int i;
+
+  if (fuzzy)
+    return fuzzymatch();
+
+  strcpy(buf, query);
+  /* separate input text into tokens to be matched individually */
+  tokc = 0;
+  for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
+    if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+      die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
+  toklen = tokc ? strlen(tokv[0]) : 0;
+  textsize = strlen(query) + 1;
+  for (textmask = 0, i = 0; i < tokc; i++)
+    textmask |= searchmask(tokv[i]);
+  return filteritems();
+}
+
+/* position of item in matchlist */
+static size_t matchpos(unsigned int item) {
+  size_t i;
+
+  for (i = 0; i < nmatches && matchlist[i] != item; i++)
+    ;
+  return i;
+}
+
+/* inserts the matches appended to matchset from index old on into the tiers
+ * of matchlist; each tier moves back by the new matches of the tiers before
+ * it, the last one first, so only the new matches are sorted in */
+static void mergetiers(size_t old, const size_t *add, int keep) {
+  size_t start[TierLast], shift[TierLast], n, i, pos;
+  int t;
+
+  for (n = 0, t = 0; t < TierLast; n += ntier[t++])
+    start[t] = n;
+  for (n = 0, t = 0; t < TierLast; n += add[t++])
+    shift[t] = n;
+  growmatchlist(nmatches + n);
+  for (t = TierLast; t-- > 0;) {
+    memmove(&matchlist[start[t] + shift[t]], &matchlist[start[t]],
+            ntier[t] * sizeof *matchlist);
+    pos = start[t] + shift[t] + ntier[t];
+    for (i = old; add[t] && i < matchsetlen; i++)
+      if (matchtier[i] == t)
+        matchlist[pos++] = matchset[i];
+  }
+  /* the selection follows its item, which the history tier may reorder */
+  for (t = 0; keep && t < TierLast; t++) {
+    if (curr >= start[t] && curr < start[t] + ntier[t])
+      curr += shift[t];
+    if (sel >= start[t] && sel < start[t] + ntier[t])
+      sel += shift[t];
+  }
+  if (add[TierHist])
+    sorthist(&matchlist[start[TierHist] + shift[TierHist]],
+             ntier[TierHist] + add[TierHist]);
+  nmatches += n;
+}
+
+/* lets the fuzzy matches appended to matchset from index old on into the
+ * ranked list: they are appended to it and only displace the worst of the
+ * sorted front, the unsorted rest between stays where it is */
+static void mergeranked(size_t old) {
+  size_t n = nrankable, total = n + matchsetlen - old, k, i;
+  struct rank t;
+
+  if (total > rankedsiz) {
+    rankedsiz = MAX(total, 2 * rankedsiz);
+    if (!(ranked = realloc(ranked, rankedsiz * sizeof *ranked)))
+      die("cannot realloc %zu bytes:", rankedsiz * sizeof *ranked);
+  }
+  for (i = n; i < total; i++) {
+    ranked[i].distance = matchdist[old + i - n];
+    ranked[i].item = matchset[old + i - n];
+  }
+  growmatchlist(total);
+  k = fuzzytop && fuzzytop < total ? fuzzytop : total;
+  if (k != nranked) {
+    rankfront(ranked, total, k);
+    for (i = 0; i < total; i++)
+      matchlist[i] = ranked[i].item;
+  } else {
+    for (i = k / 2; i-- > 0;)
+      ranksift(ranked, i, k);
+    for (i = n; i < total; i++) {
+      if (RANKBEFORE(ranked[i], ranked[0])) {
+        t = ranked[0];
+        ranked[0] = ranked[i];
+        ranked[i] = t;
+        ranksift(ranked, 0, k);
+      }
+    }
+    qsort(ranked, k, sizeof *ranked, compare_distance);
+    for (i = 0; i < k; i++)
+      matchlist[i] = ranked[i].item;
+    for (i = n; i < total; i++)
+      matchlist[i] = ranked[i].item;
+  }
+  nranked = k;
+  nrankable = nmatches = total;
+}
+
+/* filter the items from index from on, which arrived after the last pass for
+ * the current query, append their matches to matchset and merge them into the
+ * matches shown; with keep the selection stays on its item, else it goes back
+ * to the top. The cost is that of the new items, not of all matches. */
+static void extendmatches(size_t from, int keep) {
+  struct matchchunk c;
+  unsigned int selitem = 0, curritem = 0;
+  size_t old = matchsetlen;
+  int t;
+
+  prepmatchset();
+  matchsrc = NULL;
+  c.lo = from;
+  c.hi = nitems;
+  filterchunk(&c);
+  memcpy(&matchset[matchsetlen], &matchnext[from], c.len * sizeof *matchset);
+  memmove(&matchtier[matchsetlen], &matchtier[from],
+          c.len * sizeof *matchtier);
+  if (fuzzy)
+    memmove(&matchdist[matchsetlen], &matchdist[from],
+            c.len * sizeof *matchdist);
+  matchsetlen += c.len;
+  if (keep) {
+    selitem = matchlist[sel];
+    curritem = matchlist[curr];
+  }
+  if (fuzzy && textlen) {
+    mergeranked(old);
+    /* a page past the sorted front needs all of them in order, which is
+     * only paid for while the user looks there */
+    if (keep && sel >= nranked)
+      rankrest();
+    if (keep && matchlist[sel] != selitem)
+      sel = matchpos(selitem);
+    if (keep && matchlist[curr] != curritem)
+      curr = matchpos(curritem);
+  } else {
+    mergetiers(old, c.ntier, keep);
+    if (keep && matchlist[sel] != selitem)
+      sel = matchpos(selitem);
+    if (keep && matchlist[curr] != curritem)
+      curr = matchpos(curritem);
+  }
+  for (t = 0; t < TierLast; t++)
+    ntier[t] += c.ntier[t];
+  if (!keep)
+    curr = sel = 0;
+}
+
+/* with -N, prints the only match and exits once the input is complete */
+static void instantmatch(void) {
+  /* a match from the history may be a substring one */
+  if (!fuzzy && instant && !streaming && nmatches == 1 &&
+      !ntier[TierSubstr] &&
+      (!ntier[TierHist] ||
+       !strncmp(query + strspn(query, " "), ITEMKEY(matchlist[0]), toklen))) {
+    printitem(itemvalue(matchlist[0]));
+    printf("digga!!!!");
+    cleanup();
+    exit(0);
+  }
+}
+
+/* shows the result of the last completed match pass, the background matcher
+ * is idle while this runs */
+static void applymatch(void) {
+  struct rank *r;
+  size_t i, siz;
+
+  if (fuzzy && textlen) {
+    r = ranked;
+    ranked = rankbuf;
+    rankbuf = r;
+    siz = rankedsiz;
+    rankedsiz = rankbufsiz;
+    rankbufsiz = siz;
+    growmatchlist(nrankbuf);
+    for (i = 0; i < nrankbuf; i++)
+      matchlist[i] = ranked[i].item;
+    nranked = krankbuf;
+    nrankable = nmatches = nrankbuf;
+  } else {
+    linkmatches(matchsetlen);
+  }
+  curr = sel = 0;
+  instantmatch();
+  calcoffsets();
+}
+
+static void *bgworker(void *arg) {
+  unsigned int gen;
+  int finished;
+
+  pthread_mutex_lock(&bg.lock);
+  for (;;) {
+    while (!bg.quit && bg.done == bg.want)
+      pthread_cond_wait(&bg.cond, &bg.lock);
+    if (bg.quit)
+      break;
+    gen = bg.want;
+    setquery(bg.text);
+    pthread_mutex_unlock(&bg.lock);
+    passgen = gen;
+    finished = computematch();
+    pthread_mutex_lock(&bg.lock);
+    if (!finished)
+      continue;
+    bg.done = gen;
+    if (gen == bg.want) {
+      pthread_cond_broadcast(&bg.cond);
+      write(bg.fd[1], "", 1);
+    }
+  }
+  pthread_mutex_unlock(&bg.lock);
+  return NULL;
+}
+
+/* large inputs are matched off the event loop, so typing never waits for a
+ * pass that the next key press makes obsolete anyway */
+static void bgstart(void) {
+  if (bg.started || dynamic || provider || qalc.enable || !asyncmin ||
+      nitems < asyncmin)
+    return;
+  if (pipe2(bg.fd, O_NONBLOCK | O_CLOEXEC))
+    return;
+  if (pthread_create(&bg.thread, NULL, bgworker, NULL)) {
+    close(bg.fd[0]);
+    close(bg.fd[1]);
+    return;
+  }
+  bg.started = 1;
+}
 
-  if (number_of_matches) {
-    /* initialize array with matches */
-    if (!(fuzzymatches =
-              realloc(fuzzymatches, number_of_matches * sizeof(struct item *))))
-      die("cannot realloc %u bytes:",
-          number_of_matches * sizeof(struct item *));
-    for (i = 0, it = matches; it && i < number_of_matches;
-         i++, it = it->right) {
-      fuzzymatches[i] = it;
-    }
-    /* sort matches according to distance */
-    qsort(fuzzymatches, number_of_matches, sizeof(struct item *),
-          compare_distance);
-    /* rebuild list of matches */
-    matches = matchend = NULL;
-    for (i = 0, it = fuzzymatches[i]; i < number_of_matches && it && it->text;
-         i++, it = fuzzymatches[i]) {
-      appenditem(it, &matches, &matchend);
-    }
-    free(fuzzymatches);
+static void bgstop(void) {
+  if (!bg.started)
+    return;
+  pthread_mutex_lock(&bg.lock);
+  bg.quit = 1;
+  bg.want++;
+  pthread_cond_broadcast(&bg.cond);
+  pthread_mutex_unlock(&bg.lock);
+  pthread_join(bg.thread, NULL);
+  close(bg.fd[0]);
+  close(bg.fd[1]);
+  bg.started = 0;
+  matchpending = 0;
+}
+
+/* bring the matches up to date with the text, waiting for the latest
+ * requested pass */
+static void matchsync(void) {
+  if (matchstale) {
+    matchstale = 0;
+    match();
+    return;
   }
-  curr = sel = matches;
-  calcoffsets();
+  if (!matchpending)
+    return;
+  pthread_mutex_lock(&bg.lock);
+  while (bg.done != bg.want)
+    pthread_cond_wait(&bg.cond, &bg.lock);
+  pthread_mutex_unlock(&bg.lock);
+  matchpending = 0;
+  applymatch();
+}
+
+/* show the result of a finished pass unless a newer one is under way,
+ * returns whether anything changed */
+static int matchpoll(void) {
+  char buf[64];
+  int ready;
+
+  while (read(bg.fd[0], buf, sizeof buf) > 0)
+    ;
+  pthread_mutex_lock(&bg.lock);
+  ready = bg.done == bg.want;
+  pthread_mutex_unlock(&bg.lock);
+  if (!matchpending || !ready)
+    return 0;
+  matchpending = 0;
+  applymatch();
+  return 1;
 }
 
 static void readstdin(FILE *stream);
@@ -508,11 +1849,14 @@ static void init_qalc(void) {
   } else { // parent
     close(qalc.in[0]);
     close(qalc.out[1]);
-    items = malloc(sizeof(struct item) * 2);
-    items[0].text = malloc(LENGTH(qalc.buf));
-    strcpy(items[0].text, "no result");
-    items[1].out = 0;
-    items[1].text = NULL;
+    inputkeys = inputtext = ecalloc(1, LENGTH(qalc.buf));
+    inputsiz = LENGTH(qalc.buf);
+    strcpy(inputtext, "no result");
+    growitems();
+    ((uint32_t *)itemoff)[0] = 0;
+    itemmask[0] = ~(uint64_t)0; /* the text changes with every result */
+    itemflags[0] = 0;
+    nitems = 1;
   }
 }
 
@@ -525,8 +1869,11 @@ static void recv_qalc(void) {
   if (qalc.buf[0] == '\n') {
     int i;
     for (i = 3; i < LENGTH(qalc.buf) && qalc.buf[i] != '\n'; ++i)
-      items[0].text[i - 3] = qalc.buf[i];
-    items[0].text[i - 3] = 0;
+      inputtext[i - 3] = qalc.buf[i];
+    inputtext[i - 3] = 0;
+    /* the result was measured and hashed with its old text */
+    dropwidths();
+    nhashed = 0;
     if (r != LENGTH(qalc.buf))
       return;
   }
@@ -550,97 +1897,195 @@ static void match_qalc(void) {
     return;
   }
 
-  matches = matchend = NULL;
-  appenditem(items, &matches, &matchend);
-  curr = sel = matches;
+  growmatchlist(1);
+  matchlist[0] = 0;
+  nmatches = 1;
+  curr = sel = 0;
   calcoffsets();
 }
 
-static void match(void) {
-  if (fuzzy) {
-    fuzzymatch();
+/* lists every item in input order, for commands that do the matching */
+static void listitems(void) {
+  size_t i;
+
+  growmatchlist(nitems);
+  for (i = 0; i < nitems; i++)
+    matchlist[i] = i;
+  nmatches = nitems;
+}
+
+static void startprovider(void) {
+  int in[2], out[2];
+
+  if (pipe(in) == -1 || pipe(out) == -1)
+    die("pipe:");
+  if ((prov.pid = fork()) == -1)
+    die("failed to fork for provider");
+  if (prov.pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    execl("/bin/sh", "sh", "-c", provider, NULL);
+    die("execl provider failed");
+  }
+  close(in[0]);
+  close(out[1]);
+  prov.in = in[1];
+  prov.out = out[0];
+  fcntl(prov.in, F_SETFL, O_NONBLOCK);
+  fcntl(prov.out, F_SETFL, O_NONBLOCK);
+  /* a provider that quits shows up as EPIPE */
+  signal(SIGPIPE, SIG_IGN);
+}
+
+static void queryprovider(void);
+
+/* stops sending queries to a provider that quit; its last items stay */
+static void closeprovider(void) {
+  if (prov.in >= 0)
+    close(prov.in);
+  prov.in = -1;
+  prov.qlen = prov.qoff = 0;
+  prov.resend = 0;
+}
+
+/* writes what the pipe takes of the pending query */
+static void flushprovider(void) {
+  ssize_t r;
+
+  while (prov.qoff < prov.qlen) {
+    if ((r = write(prov.in, prov.query + prov.qoff, prov.qlen - prov.qoff)) <
+        0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EPIPE) {
+        closeprovider();
+        return;
+      }
+      die("cannot write to provider:");
+    }
+    prov.qoff += r;
+  }
+  prov.qlen = prov.qoff = 0;
+  if (prov.resend) {
+    prov.resend = 0;
+    queryprovider();
+  }
+}
+
+/* sends the text under the next id; a query the pipe had no room for yet is
+ * replaced, one that is partly written is finished first */
+static void queryprovider(void) {
+  if (prov.in < 0)
     return;
+  if (prov.qoff) {
+    prov.resend = 1;
+    return;
+  }
+  prov.want++;
+  prov.qlen = snprintf(prov.query, sizeof prov.query, "%lu\t%s\n", prov.want,
+                       text);
+  flushprovider();
+}
+
+/* takes one line of provider output, returns whether the items changed */
+static int providerline(char *line, size_t len) {
+  unsigned long id;
+  char *end;
+
+  id = strtoul(line, &end, 10);
+  if (end == line || (*end != '\t' && end != line + len) || id != prov.want)
+    return 0;
+  if (prov.got != id) { /* the first line of the latest batch */
+    freeinput();
+    nitems = 0;
+    prov.got = id;
+    prov.done = 0;
+    curr = sel = 0;
+  } else if (prov.done) {
+    return 0;
+  }
+  if (end == line + len)
+    prov.done = 1;
+  else
+    addline(end + 1, line + len - end - 1);
+  return 1;
+}
+
+/* reads what the provider has written, returns whether the items changed */
+static int readprovider(void) {
+  ssize_t r;
+  char *p, *nl;
+  int changed = 0;
+
+  if (prov.siz - prov.len < BUFSIZ &&
+      !(prov.buf = realloc(prov.buf, (prov.siz = prov.siz * 2 + BUFSIZ))))
+    die("cannot realloc %zu bytes:", prov.siz);
+  if ((r = read(prov.out, prov.buf + prov.len, prov.siz - prov.len)) < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    die("cannot read from provider:");
+  }
+  if (!r) { /* the provider quit, keep showing its last items */
+    close(prov.out);
+    prov.out = -1;
+    closeprovider();
+    return 0;
+  }
+  prov.len += r;
+  for (p = prov.buf; (nl = memchr(p, '\n', prov.buf + prov.len - p));
+       p = nl + 1)
+    changed |= providerline(p, nl - p);
+  memmove(prov.buf, p, prov.len -= p - prov.buf);
+  if (changed) {
+    listitems();
+    calcoffsets();
   }
-  static char **tokv = NULL;
-  static int tokn = 0;
+  return changed;
+}
 
-  char buf[sizeof text], *s;
-  int i, tokc = 0;
-  size_t len, textsize;
-  struct item *item, *lhpprefix, *lprefix, *lsubstr, *hpprefixend, *prefixend,
-      *substrend;
+/* hand the text to the background matcher, cancelling the pass under way;
+ * the matches shown stay those of the previous text until it is done */
+static void matchasync(void) {
+  if (!bg.started || dynamic) {
+    match();
+    return;
+  }
+  pthread_mutex_lock(&bg.lock);
+  strcpy(bg.text, text);
+  bg.want++;
+  pthread_cond_broadcast(&bg.cond);
+  pthread_mutex_unlock(&bg.lock);
+  matchpending = 1;
+}
 
+static void match(void) {
+  matchstale = 0;
+  if (provider) {
+    queryprovider();
+    return;
+  }
   if (dynamic) {
     refreshoptions();
-    matches = matchend = NULL;
-    for (item = items; item && item->text; item++)
-      appenditem(item, &matches, &matchend);
-    curr = sel = matches;
+    listitems();
+    curr = sel = 0;
     calcoffsets();
     return;
   }
-
-  strcpy(buf, text);
-  /* separate input text into tokens to be matched individually */
-  for (s = strtok(buf, " "); s; tokv[tokc - 1] = s, s = strtok(NULL, " "))
-    if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-      die("cannot realloc %zu bytes:", tokn * sizeof *tokv);
-  len = tokc ? strlen(tokv[0]) : 0;
-
-  matches = lhpprefix = lprefix = lsubstr = matchend = hpprefixend = prefixend =
-      substrend = NULL;
-  textsize = strlen(text) + 1;
-  for (item = items; item && item->text; item++) {
-    for (i = 0; i < tokc; i++)
-      if (!fstrstr(item->text, tokv[i]))
-        break;
-    if (i != tokc) /* not all tokens match */
-      continue;
-    /* exact matches go first, then prefixes with high priority, then prefixes,
-     * then substrings */
-    if (!tokc || !fstrncmp(text, item->text, textsize))
-      appenditem(item, &matches, &matchend);
-    else if (item->hp && !fstrncmp(tokv[0], item->text, len))
-      appenditem(item, &lhpprefix, &hpprefixend);
-    else if (!fstrncmp(tokv[0], item->text, len))
-      appenditem(item, &lprefix, &prefixend);
-    else
-      appenditem(item, &lsubstr, &substrend);
-  }
-  if (lhpprefix) {
-    if (matches) {
-      matchend->right = lhpprefix;
-      lhpprefix->left = matchend;
-    } else
-      matches = lhpprefix;
-    matchend = hpprefixend;
-  }
-  if (lprefix) {
-    if (matches) {
-      matchend->right = lprefix;
-      lprefix->left = matchend;
-    } else
-      matches = lprefix;
-    matchend = prefixend;
-  }
-  if (lsubstr) {
-    if (matches) {
-      matchend->right = lsubstr;
-      lsubstr->left = matchend;
-    } else
-      matches = lsubstr;
-    matchend = substrend;
-  }
-  curr = sel = matches;
-
-  if (instant && matches && matches == matchend && !lsubstr) {
-    puts(matches->text);
-    printf("digga!!!!");
-    cleanup();
-    exit(0);
+  if (bg.started) {
+    matchasync();
+    matchsync();
+    return;
   }
-
-  calcoffsets();
+  setquery(text);
+  computematch();
+  applymatch();
 }
 
 static void insert(const char *str, ssize_t n) {
@@ -651,7 +2096,7 @@ static void insert(const char *str, ssize_t n) {
   if (n > 0)
     memcpy(&text[cursor], str, n);
   cursor += n;
-  match();
+  matchstale = 1;
 }
 
 static size_t nextrune(int inc) {
@@ -743,7 +2188,7 @@ static void keypress(XKeyEvent *ev) {
     case XK_F: /* delete right */
       if (draw_input) {
         text[cursor] = '\0';
-        match();
+        matchstale = 1;
       }
       break;
     case XK_u: /* delete left */
@@ -832,36 +2277,40 @@ static void keypress(XKeyEvent *ev) {
     break;
   case XK_End:
   case XK_KP_End:
+    matchsync();
     if (text[cursor] != '\0' && draw_input) {
       cursor = strlen(text);
       break;
     }
-    if (next) {
+    rankrest();
+    if (next < nmatches) {
       /* jump to end of list and position items in reverse */
-      curr = matchend;
+      curr = nmatches - 1;
       calcoffsets();
       curr = prev;
       calcoffsets();
-      while (next && (curr = curr->right))
+      while (next < nmatches && ++curr < nmatches)
         calcoffsets();
     }
-    sel = matchend;
+    sel = nmatches ? nmatches - 1 : 0;
     break;
   case XK_Escape:
     cleanup();
     exit(1);
   case XK_Home:
   case XK_KP_Home:
-    if (sel == matches) {
+    matchsync();
+    if (sel == 0) {
       cursor = 0;
       break;
     }
-    sel = curr = matches;
+    sel = curr = 0;
     calcoffsets();
     break;
   case XK_Left:
   case XK_KP_Left:
-    if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+    matchsync();
+    if (cursor > 0 && (!nmatches || !sel || lines > 0)) {
       cursor = nextrune(-1);
       break;
     }
@@ -870,41 +2319,52 @@ static void keypress(XKeyEvent *ev) {
     /* fallthrough */
   case XK_Up:
   case XK_KP_Up:
-    if (sel && sel->left && (sel = sel->left)->right == curr) {
+    matchsync();
+    if (nmatches && sel > 0 && sel-- == curr) {
       curr = prev;
       calcoffsets();
     }
     break;
   case XK_Next:
   case XK_KP_Next:
-    if (!next)
+    matchsync();
+    if (next >= nmatches)
       return;
     sel = curr = next;
     calcoffsets();
     break;
   case XK_Prior:
   case XK_KP_Prior:
-    if (!prev)
+    matchsync();
+    if (!nmatches)
       return;
     sel = curr = prev;
     calcoffsets();
     break;
   case XK_Return:
   case XK_KP_Enter:
+    matchsync();
     if (print_index)
-      printf("%d\n", (sel && !(ev->state & ShiftMask)) ? sel->index : -1);
+      printf("%d\n", (nmatches && !(ev->state & ShiftMask))
+                         ? (int)itemindex(matchlist[sel])
+                         : -1);
     else
-      puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
+      printitem((nmatches && !(ev->state & ShiftMask))
+                    ? itemvalue(matchlist[sel])
+                    : text);
 
+    if (nmatches && !(ev->state & ShiftMask))
+      histbump(matchlist[sel]);
     if (!(ev->state & ControlMask)) {
       cleanup();
       exit(0);
     }
-    if (sel)
-      sel->out = 1;
+    if (nmatches)
+      itemflags[matchlist[sel]] |= ItemOut;
     break;
   case XK_Right:
   case XK_KP_Right:
+    matchsync();
     if (text[cursor] != '\0') {
       cursor = nextrune(+1);
       break;
@@ -914,16 +2374,18 @@ static void keypress(XKeyEvent *ev) {
     /* fallthrough */
   case XK_Down:
   case XK_KP_Down:
-    if (sel && sel->right && (sel = sel->right) == next) {
+    matchsync();
+    if (nmatches && sel + 1 < nmatches && ++sel == next) {
       curr = next;
       calcoffsets();
     }
     break;
   case XK_Tab:
-    if (!sel || !draw_input)
+    matchsync();
+    if (!nmatches || !draw_input)
       return;
-    cursor = strnlen(sel->text, sizeof text - 1);
-    memcpy(text, sel->text, cursor);
+    cursor = strnlen(ITEMTEXT(matchlist[sel]), sizeof text - 1);
+    memcpy(text, ITEMTEXT(matchlist[sel]), cursor);
     text[cursor] = '\0';
     match();
     break;
@@ -933,16 +2395,17 @@ static void keypress(XKeyEvent *ev) {
     send_qalc();
 
 draw:
-  drawmenu();
+  redraw = 1;
 }
 
 static void buttonpress(XEvent *e) {
-  struct item *item;
+  size_t item;
   XButtonPressedEvent *ev = &e->xbutton;
   int x = 0, y = 0, h = bh, w;
 
   if (ev->window != win)
     return;
+  matchsync();
 
   /* right-click: exit */
   if (ev->button == Button3)
@@ -952,14 +2415,14 @@ static void buttonpress(XEvent *e) {
     x += promptw;
 
   /* input field */
-  w = (lines > 0 || !matches) ? mw - x : inputw;
+  w = (lines > 0 || !nmatches) ? mw - x : inputw;
 
   /* left-click on input: clear input,
    * NOTE: if there is no left-arrow the space for < is reserved so
    *       add that to the input width */
   if (ev->button == Button1 &&
       ((lines <= 0 && ev->x >= 0 &&
-        ev->x <= x + w + ((!prev || !curr->left) ? TEXTW("<") : 0)) ||
+        ev->x <= x + w + ((!nmatches || !curr) ? TEXTW("<") : 0)) ||
        (lines > 0 && ev->y >= y && ev->y <= y + h))) {
     insert(NULL, -cursor);
     drawmenu();
@@ -973,14 +2436,14 @@ static void buttonpress(XEvent *e) {
     return;
   }
   /* scroll up */
-  if (ev->button == Button4 && prev) {
+  if (ev->button == Button4 && nmatches) {
     sel = curr = prev;
     calcoffsets();
     drawmenu();
     return;
   }
   /* scroll down */
-  if (ev->button == Button5 && next) {
+  if (ev->button == Button5 && next < nmatches) {
     sel = curr = next;
     calcoffsets();
     drawmenu();
@@ -993,25 +2456,24 @@ static void buttonpress(XEvent *e) {
   if (lines > 0) {
     /* vertical list: (ctrl)left-click on item */
     w = mw - x;
-    for (item = curr; item != next; item = item->right) {
+    for (item = curr; item < next; item++) {
       y += h;
       if (ev->y >= y && ev->y <= (y + h)) {
-        puts(item->text);
+        printitem(itemvalue(matchlist[item]));
+        histbump(matchlist[item]);
         if (!(ev->state & ControlMask))
           exit(0);
         sel = item;
-        if (sel) {
-          sel->out = 1;
-          drawmenu();
-        }
+        itemflags[matchlist[sel]] |= ItemOut;
+        drawmenu();
         return;
       }
     }
-  } else if (matches) {
+  } else if (nmatches) {
     /* left-click on left arrow */
     x += inputw;
     w = TEXTW("<");
-    if (prev && curr->left) {
+    if (curr > 0) {
       if (ev->x >= x && ev->x <= x + w) {
         sel = curr = prev;
         calcoffsets();
@@ -1020,25 +2482,24 @@ static void buttonpress(XEvent *e) {
       }
     }
     /* horizontal list: (ctrl)left-click on item */
-    for (item = curr; item != next; item = item->right) {
+    for (item = curr; item < next; item++) {
       x += w;
-      w = MIN(TEXTW(item->text), mw - x - TEXTW(">"));
+      w = itemw_clamp(matchlist[item], mw - x - TEXTW(">"));
       if (ev->x >= x && ev->x <= x + w) {
-        puts(item->text);
+        printitem(itemvalue(matchlist[item]));
+        histbump(matchlist[item]);
         if (!(ev->state & ControlMask))
           exit(0);
         sel = item;
-        if (sel) {
-          sel->out = 1;
-          drawmenu();
-        }
+        itemflags[matchlist[sel]] |= ItemOut;
+        drawmenu();
         return;
       }
     }
     /* left-click on right arrow */
     w = TEXTW(">");
     x = mw - w;
-    if (next && ev->x >= x && ev->x <= x + w) {
+    if (next < nmatches && ev->x >= x && ev->x <= x + w) {
       sel = curr = next;
       calcoffsets();
       drawmenu();
@@ -1048,16 +2509,20 @@ static void buttonpress(XEvent *e) {
 }
 
 static void motionevent(XButtonEvent *ev) {
-  struct item *it;
+  size_t it;
   int xy, ev_xy;
 
-  if (ev->window != win || matches == 0)
+  if (ev->window != win)
+    return;
+  matchsync();
+  if (!nmatches)
     return;
 
   xy = lines > 0 ? bh : inputw + promptw + TEXTW("<");
   ev_xy = lines > 0 ? ev->y : ev->x;
-  for (it = curr; it && it != next; it = it->right) {
-    int wh = lines > 0 ? bh : textw_clamp(it->text, mw - xy - TEXTW(">"));
+  for (it = curr; it < next; it++) {
+    int wh = lines > 0 ? bh
+                       : itemw_clamp(matchlist[it], mw - xy - TEXTW(">"));
     if (ev_xy >= xy && ev_xy < (xy + wh)) {
       sel = it;
       calcoffsets();
@@ -1082,15 +2547,251 @@ static void paste(void) {
     XFree(p);
   }
   if (incremental) {
-    puts(text);
+    printitem(text);
     fflush(stdout);
   }
-  drawmenu();
+  redraw = 1;
+}
+
+static int ishp(const char *text) {
+  return hpitems &&
+         bsearch(&text, hpitems, hplength, sizeof *hpitems, str_compar);
+}
+
+static void markhp(void) {
+  size_t i;
+
+  for (i = 0; hpitems && i < nitems; i++)
+    if (ishp(ITEMTEXT(i)))
+      itemflags[i] |= ItemHp;
+}
+
+static void freeinput(void) {
+  if (inputkeys != inputtext && !itemsmapped)
+    free(inputkeys);
+  if (inputmap)
+    munmap(inputmap, inputmapsize);
+  else
+    free(inputtext);
+  if (itemsmapped) {
+    itemoff = NULL;
+    itemmask = NULL;
+    itemflags = NULL;
+    itemsiz = 0;
+    wideoff = 0;
+  }
+  dropwidths();
+  nhashed = 0;
+  inputtext = inputkeys = NULL;
+  inputlen = inputsiz = 0;
+  inputmap = NULL;
+  itemsmapped = 0;
+}
+
+/* makes room for one more item */
+static void growitems(void) {
+  if (nitems < itemsiz)
+    return;
+  itemsiz = itemsiz ? itemsiz * 2 : 256;
+  if (!(itemoff = realloc(itemoff, itemsiz * OFFSIZE)) ||
+      !(itemmask = realloc(itemmask, itemsiz * sizeof *itemmask)) ||
+      !(itemflags = realloc(itemflags, itemsiz * sizeof *itemflags)))
+    die("cannot realloc %zu bytes:", itemsiz * sizeof *itemmask);
+}
+
+/* switches the item offsets to 64 bit, once the text no longer fits 32 */
+static void widenoffsets(void) {
+  uint64_t *w;
+  size_t i;
+
+  if (!(w = malloc(itemsiz * sizeof *w)))
+    die("cannot malloc %zu bytes:", itemsiz * sizeof *w);
+  for (i = 0; i < nitems; i++)
+    w[i] = ((uint32_t *)itemoff)[i];
+  free(itemoff);
+  itemoff = w;
+  wideoff = 1;
+}
+
+/* appends an item for the NUL-terminated text at offset off of the input */
+static void additem(size_t off) {
+  growitems();
+  if (!wideoff && off > UINT32_MAX)
+    widenoffsets();
+  if (wideoff)
+    ((uint64_t *)itemoff)[nitems] = off;
+  else
+    ((uint32_t *)itemoff)[nitems] = off;
+  itemmask[nitems] = searchmask(inputtext + off);
+  itemflags[nitems] = ishp(inputtext + off) ? ItemHp : 0;
+  nitems++;
+}
+
+/* makes room for n more bytes of input text */
+static void growinput(size_t n) {
+  if (inputsiz - inputlen >= n)
+    return;
+  while (inputsiz - inputlen < n)
+    inputsiz = inputsiz ? inputsiz * 2 : 1 << 16;
+  if (!(inputtext = realloc(inputtext, inputsiz)) ||
+      (casefold && !(inputkeys = realloc(inputkeys, inputsiz))))
+    die("cannot realloc %zu bytes:", inputsiz);
+  if (!casefold)
+    inputkeys = inputtext;
+}
+
+/* copies the len bytes at s and a NUL to the end of the input text, returns
+ * their offset; with -i their key is folded right away, so that matching
+ * compares plain bytes */
+static size_t addtext(const char *s, size_t len) {
+  size_t off = inputlen;
+
+  growinput(len + 1);
+  memcpy(&inputtext[off], s, len);
+  inputtext[off + len] = '\0';
+  if (casefold)
+    searchfold(&inputkeys[off], &inputtext[off], len + 1);
+  inputlen += len + 1;
+  return off;
+}
+
+static void addline(const char *s, size_t len) { additem(addtext(s, len)); }
+
+/* adds an item for each complete line among the len bytes at buf, returns
+ * the number of bytes they take up */
+static size_t addlines(const char *buf, size_t len) {
+  const char *p, *nl;
+
+  for (p = buf; (nl = memchr(p, delim, buf + len - p)); p = nl + 1)
+    addline(p, nl - p);
+  return p - buf;
+}
+
+static uint32_t getle32(const unsigned char *p) {
+  return p[0] | p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* adds an item for each complete -B record among the len bytes at buf,
+ * returns the number of bytes they take up. A record is, in little-endian:
+ *   flags    1 byte, RecHp, RecIndex and RecDisplay or'ed together
+ *   length   4 bytes, of the value
+ *   index    4 bytes if RecIndex, printed by -ix instead of the position
+ *   dlength  4 bytes if RecDisplay, of the display text
+ *   display  dlength bytes, shown and matched instead of the value
+ *   value    length bytes, printed when the item is selected
+ * The index goes in front of the text, the value behind it. */
+static size_t addrecords(const char *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf, *end = p + len, *q;
+  size_t vlen, dlen, off;
+  uint32_t index = 0;
+  int flags;
+
+  for (; end - p >= 5; p = q + dlen + vlen) {
+    flags = p[0];
+    vlen = getle32(p + 1);
+    dlen = 0;
+    q = p + 5;
+    if (flags & RecIndex) {
+      if (end - q < 4)
+        break;
+      index = getle32(q);
+      q += 4;
+    }
+    if (flags & RecDisplay) {
+      if (end - q < 4)
+        break;
+      dlen = getle32(q);
+      q += 4;
+    }
+    if ((size_t)(end - q) < dlen + vlen)
+      break;
+    if (flags & RecIndex) {
+      growinput(sizeof index);
+      memcpy(&inputtext[inputlen], &index, sizeof index);
+      inputlen += sizeof index;
+    }
+    if (flags & RecDisplay) {
+      off = addtext((const char *)q, dlen);
+      addtext((const char *)q + dlen, vlen);
+    } else {
+      off = addtext((const char *)q, vlen);
+    }
+    additem(off);
+    itemflags[nitems - 1] |= (flags & RecHp ? ItemHp : 0) |
+                             (flags & RecIndex ? ItemIndex : 0) |
+                             (flags & RecDisplay ? ItemValue : 0);
+  }
+  return (const char *)p - buf;
+}
+
+/* reads all -B records of stream */
+static void readrecords(FILE *stream) {
+  char *buf = NULL;
+  size_t len = 0, siz = 0, r;
+
+  for (;;) {
+    if (siz - len < BUFSIZ && !(buf = realloc(buf, (siz = siz * 2 + BUFSIZ))))
+      die("cannot realloc %zu bytes:", siz);
+    if (!(r = fread(buf + len, 1, siz - len, stream)))
+      break;
+    len += r;
+    r = addrecords(buf, len);
+    memmove(buf, buf + r, len -= r);
+  }
+  if (ferror(stream))
+    die("cannot read input:");
+  if (len)
+    die("incomplete record at end of input");
+  free(buf);
+}
+
+/* maps the rest of fd if it is a regular file and turns its lines into items
+ * in place; the mapping is private, so only the pages whose newlines become
+ * NULs get copied, and with -0 none */
+static int mapinput(int fd) {
+  struct stat st;
+  off_t off;
+  size_t size;
+  char *p, *nl, *end;
+
+  if (records || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+      (off = lseek(fd, 0, SEEK_CUR)) < 0 || st.st_size <= off)
+    return 0;
+  size = st.st_size;
+  /* one byte more, so that even a last line without newline is terminated:
+   * the tail of the last page of the file reads as zeros, and behind a file
+   * that ends on a page boundary lies the anonymous page */
+  p = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  if (p == MAP_FAILED)
+    return 0;
+  if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+      MAP_FAILED) {
+    munmap(p, size + 1);
+    return 0;
+  }
+  madvise(p, size, MADV_SEQUENTIAL);
+  inputtext = inputkeys = inputmap = p;
+  inputmapsize = size + 1;
+  end = p + size;
+  for (p += off; p < end; p = nl + 1) {
+    if (!(nl = memchr(p, delim, end - p)))
+      nl = end;
+    if (*nl) /* a store would copy the page even if it changed nothing */
+      *nl = '\0';
+    additem(p - inputtext);
+  }
+  if (casefold) {
+    if (!(inputkeys = malloc(size + 1)))
+      die("cannot malloc %zu bytes:", size + 1);
+    searchfold(inputkeys, inputtext, size + 1);
+  }
+  return 1;
 }
 
 static void readstdin(FILE *stream) {
   char *line = NULL;
-  size_t i, itemsiz = 0, linesiz = 0;
+  size_t linesiz = 0;
   ssize_t len;
 
   if (passwd) {
@@ -1098,32 +2799,332 @@ static void readstdin(FILE *stream) {
     return;
   }
 
-  if (hpitems && hplength > 0)
-    qsort(hpitems, hplength, sizeof *hpitems, str_compar);
-
   /* read each line from stdin and add it to the item list */
-  for (i = 0; (len = getline(&line, &linesiz, stream)) != -1;
-       i++, line = NULL) {
-    if (i + 1 >= itemsiz) {
-      itemsiz += 256;
-      if (!(items = realloc(items, itemsiz * sizeof(*items))))
-        die("cannot realloc %zu bytes:", itemsiz * sizeof(*items));
+  freeinput();
+  nitems = 0;
+  if (records) {
+    readrecords(stream);
+  } else if (!mapinput(fileno(stream))) {
+    while ((len = getdelim(&line, &linesiz, delim, stream)) != -1) {
+      if (line[len - 1] == delim)
+        line[--len] = '\0';
+      addline(line, len);
+    }
+    free(line);
+  }
+  matchsetvalid = 0;
+  cacheclear();
+  lines = MIN(max_lines, nitems);
+}
+
+/* A -cache snapshot holds the parsed input of a regular file: the text, the
+ * keys with -i, the item arrays and the item widths for the fonts named in
+ * it, each section at an offset aligned for its type. It is valid as long
+ * as the file and the options that shape the items stay the same. */
+#define SNAPMAGIC "dmenusnp"
+#define SNAPVERSION 3
+enum {
+  SnapKeys = 1,
+  SnapNul = 2,
+  SnapRecords = 4,
+  SnapWideOff = 8,
+  SnapWidths = 16 /* every width is known */
+};
+struct snaphdr {
+  char magic[8];
+  uint32_t version, flags;
+  uint64_t dev, ino, size, mtime, mtimensec, start; /* the input file */
+  uint64_t nitems, textlen;
+  uint64_t text, keys, off, mask, itemflags, width, font, fontlen;
+};
+/* the input the snapshot was made of, and whether it still lacks widths that
+ * are measured later, see snapwidths() */
+static struct snaphdr snapsrc;
+static int snapstale = 0;
+
+/* the font names the widths were measured with */
+static size_t snapfont(char *buf, size_t size) {
+  size_t i, n = 0;
+
+  for (i = 0; i < LENGTH(fonts); i++)
+    n += snprintf(buf + MIN(n, size), size - MIN(n, size), "%s\n", fonts[i]);
+  return n;
+}
+
+/* fills in what identifies the input on stdin, returns 0 unless it is a
+ * regular file */
+static int snapsource(struct snaphdr *h) {
+  struct stat st;
+  off_t start;
+
+  if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) ||
+      (start = lseek(STDIN_FILENO, 0, SEEK_CUR)) < 0)
+    return 0;
+  memset(h, 0, sizeof *h);
+  memcpy(h->magic, SNAPMAGIC, sizeof h->magic);
+  h->version = SNAPVERSION;
+  h->flags = (nulsep ? SnapNul : 0) | (records ? SnapRecords : 0);
+  h->dev = st.st_dev;
+  h->ino = st.st_ino;
+  h->size = st.st_size;
+  h->mtime = st.st_mtim.tv_sec;
+  h->mtimensec = st.st_mtim.tv_nsec;
+  h->start = start;
+  return 1;
+}
+
+/* whether n elements of elsize bytes at off lie within size bytes, aligned
+ * for their type; safe against overflow for any values read from a file */
+static int snapfits(uint64_t off, uint64_t n, size_t elsize, uint64_t size) {
+  return off <= size && !(off % elsize) && n <= (size - off) / elsize;
+}
+
+/* maps the snapshot if it matches the input described by want and makes its
+ * items the input */
+static int loadsnapshot(const struct snaphdr *want) {
+  struct snaphdr *h;
+  struct stat st;
+  char font[BUFSIZ], *map;
+  size_t fontlen, offsize;
+  uint64_t lastoff;
+  int fd;
+
+  if ((fd = open(snapfile, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof *h ||
+      (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                  0)) == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  close(fd);
+  h = (struct snaphdr *)map;
+  offsize = h->flags & SnapWideOff ? sizeof(uint64_t) : sizeof(uint32_t);
+  /* the header is checked first and the sections to lie in the file, before
+   * anything in them is read; the offsets in them are trusted but the last.
+   * -i needs the keys, or the snapshot is written anew with them */
+  if (memcmp(h->magic, want->magic, sizeof h->magic) ||
+      h->version != want->version ||
+      (h->flags & ~(SnapKeys | SnapWideOff | SnapWidths)) != want->flags ||
+      (casefold && !(h->flags & SnapKeys)) || h->dev != want->dev ||
+      h->ino != want->ino || h->size != want->size || h->mtime != want->mtime ||
+      h->mtimensec != want->mtimensec || h->start != want->start ||
+      h->nitems > UINT32_MAX ||
+      !snapfits(h->font, h->fontlen, 1, st.st_size) ||
+      !snapfits(h->text, h->textlen, 1, st.st_size) ||
+      ((h->flags & SnapKeys) &&
+       !snapfits(h->keys, h->textlen, 1, st.st_size)) ||
+      !snapfits(h->off, h->nitems, offsize, st.st_size) ||
+      !snapfits(h->mask, h->nitems, sizeof *itemmask, st.st_size) ||
+      !snapfits(h->itemflags, h->nitems, sizeof *itemflags, st.st_size) ||
+      !snapfits(h->width, h->nitems, sizeof *itemwidth, st.st_size))
+    goto stale;
+  if (h->nitems) {
+    lastoff = h->flags & SnapWideOff
+                  ? ((uint64_t *)(map + h->off))[h->nitems - 1]
+                  : ((uint32_t *)(map + h->off))[h->nitems - 1];
+    if (!h->textlen || map[h->text + h->textlen - 1] || lastoff >= h->textlen)
+      goto stale;
+  }
+
+  freeinput();
+  inputmap = map;
+  inputmapsize = st.st_size;
+  itemsmapped = 1;
+  inputtext = inputkeys = map + h->text;
+  inputlen = inputsiz = h->textlen;
+  itemoff = map + h->off;
+  wideoff = !!(h->flags & SnapWideOff);
+  itemmask = (uint64_t *)(map + h->mask);
+  itemflags = (unsigned char *)(map + h->itemflags);
+  nitems = itemsiz = h->nitems;
+  if (casefold)
+    inputkeys = map + h->keys;
+  fontlen = snapfont(font, sizeof font);
+  if (fontlen == h->fontlen && fontlen < sizeof font &&
+      !memcmp(font, map + h->font, fontlen)) {
+    itemwidth = (uint16_t *)(map + h->width);
+    nwidths = nitems;
+    widthsmapped = 1;
+    widthsall = !!(h->flags & SnapWidths);
+  }
+  markhp();
+  matchsetvalid = 0;
+  cacheclear();
+  lines = MIN(max_lines, nitems);
+  return 1;
+stale:
+  munmap(map, st.st_size);
+  return 0;
+}
+
+/* appends n bytes at the next offset aligned to align, returns the offset */
+static uint64_t snapwrite(FILE *fp, const void *p, size_t n, size_t align) {
+  long off = ftell(fp);
+
+  for (; off % align; off++)
+    fputc(0, fp);
+  fwrite(p, 1, n, fp);
+  return off;
+}
+
+/* writes the items read from the input described by h to the snapshot,
+ * replacing it at once */
+static void savesnapshot(struct snaphdr h) {
+  char font[BUFSIZ], tmp[PATH_MAX];
+  /* the text of mapped stdin is all of the mapping, that of a loaded
+   * snapshot only its text section */
+  int whole = inputmap && !itemsmapped;
+  const char *text = whole ? inputmap : inputtext;
+  size_t len = whole ? inputmapsize : inputlen, i;
+  unsigned char *flags;
+  uint16_t *width;
+  FILE *fp;
+
+  if (!nitems ||
+      snprintf(tmp, sizeof tmp, "%s.%d", snapfile, (int)getpid()) >=
+          (int)sizeof tmp ||
+      !(fp = fopen(tmp, "w")))
+    return;
+  flags = ecalloc(nitems, sizeof *flags);
+  width = ecalloc(nitems, sizeof *width);
+  h.flags |= SnapWidths;
+  for (i = 0; i < nitems; i++) {
+    /* -hp marks are redone on load, -B ones are part of the input */
+    flags[i] = itemflags[i] & (ItemValue | ItemIndex | (records ? ItemHp : 0));
+    /* measuring the rest would hold up the menu, snapwidths() writes them
+     * once -c has measured them all */
+    if ((width[i] = i < nwidths ? itemwidth[i] : WIDTHUNKNOWN) == WIDTHUNKNOWN)
+      h.flags &= ~SnapWidths;
+  }
+  h.nitems = nitems;
+  h.textlen = len;
+  h.fontlen = snapfont(font, sizeof font);
+  fwrite(&h, sizeof h, 1, fp);
+  h.text = snapwrite(fp, text, len, 1);
+  if (casefold) {
+    h.flags |= SnapKeys;
+    h.keys = snapwrite(fp, inputkeys, len, 1);
+  }
+  if (wideoff)
+    h.flags |= SnapWideOff;
+  h.off = snapwrite(fp, itemoff, nitems * OFFSIZE, OFFSIZE);
+  h.mask = snapwrite(fp, itemmask, nitems * sizeof *itemmask, sizeof *itemmask);
+  h.itemflags = snapwrite(fp, flags, nitems, 1);
+  h.width = snapwrite(fp, width, nitems * sizeof *width, sizeof *width);
+  h.font = snapwrite(fp, font, MIN(h.fontlen, sizeof font), 1);
+  rewind(fp);
+  fwrite(&h, sizeof h, 1, fp);
+  if (fclose(fp) || h.fontlen >= sizeof font || rename(tmp, snapfile))
+    unlink(tmp);
+  free(flags);
+  free(width);
+}
+
+/* rewrites the snapshot once every width is known, so that the next menu
+ * sized for its widest item measures none */
+static void snapwidths(void) {
+  if (!snapstale)
+    return;
+  snapstale = 0;
+  savesnapshot(snapsrc);
+}
+
+/* reads stdin, from the -cache snapshot if it is up to date */
+static void readinput(void) {
+  struct snaphdr h;
+
+  if (passwd || !snapfile || !snapsource(&h)) {
+    readstdin(stdin);
+    return;
+  }
+  if (!loadsnapshot(&h)) {
+    readstdin(stdin);
+    savesnapshot(h);
+  }
+  snapsrc = h;
+  snapstale = !widthsall;
+}
+
+/* shows the menu before the input is complete, see readstream() */
+static void streamstart(void) {
+  struct stat st;
+  int flags;
+
+  /* a regular file is complete already and gets mapped instead */
+  if (!fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode)) {
+    readinput();
+    return;
+  }
+  if ((flags = fcntl(STDIN_FILENO, F_GETFL)) == -1 ||
+      fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) == -1)
+    die("fcntl:");
+  streaming = 1;
+  lines = max_lines;
+}
+
+/* adds the complete lines stdin has to offer without blocking, at most about
+ * a mebibyte at a time to keep the menu responsive */
+static void readstream(void) {
+  static char *buf = NULL;
+  static size_t len = 0, siz = 0;
+  size_t total = 0;
+  ssize_t r;
+  size_t n;
+
+  while (streaming && total < (1 << 20)) {
+    if (siz - len < BUFSIZ && !(buf = realloc(buf, (siz = siz * 2 + BUFSIZ))))
+      die("cannot realloc %zu bytes:", siz);
+    if ((r = read(STDIN_FILENO, buf + len, siz - len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      die("read:");
+    }
+    if (!r) { /* the last line may lack a newline */
+      if (len && records)
+        die("incomplete record at end of input");
+      if (len)
+        addline(buf, len);
+      streaming = 0;
+      free(buf);
+      buf = NULL;
+      len = siz = 0;
+      break;
     }
-    if (line[len - 1] == '\n')
-      line[len - 1] = '\0';
-    if (!(items[i].text = strdup(line)))
-      die("strdup:");
-
-    items[i].out = 0;
-    items[i].index = i;
-    if (hpitems != NULL) {
-      items[i].hp = (int)bsearch(&items[i].text, hpitems, hplength,
-                                 sizeof *hpitems, str_compar);
+    total += r;
+    len += r;
+    n = records ? addrecords(buf, len) : addlines(buf, len);
+    memmove(buf, buf + n, len -= n);
+  }
+}
+
+/* reads more of the input and merges the new items into the matches, keeping
+ * the selection; run() only calls it while no match pass is under way */
+static void streamitems(void) {
+  size_t from = nitems;
+  int keep = nmatches && sel;
+
+  readstream();
+  cacheclear();
+  if (!matchsetvalid || strcmp(matchsettext, query)) {
+    matchasync();
+  } else {
+    extendmatches(from, keep);
+    if (!streaming)
+      instantmatch();
+    calcoffsets();
+    /* new matches may have pushed the selection off the page */
+    if (keep && sel >= next) {
+      curr = sel;
+      calcoffsets();
     }
   }
-  if (items)
-    items[i].text = NULL;
-  lines = MIN(max_lines, i);
+  if (!streaming)
+    tristart();
+  bgstart();
+  redraw = 1;
 }
 
 void resource_load(XrmDatabase db, char *name, enum resource_type rtype,
@@ -1170,21 +3171,78 @@ void load_xresources(void) {
   XCloseDisplay(display);
 }
 
+/* measures the next items for -c, and once they all are, resizes the menu
+ * if its estimated width was off */
+static void measurewidths(void) {
+  size_t end = MIN(fit.next + 4096, nitems);
+
+  for (; fit.next < end; fit.next++)
+    fit.max = MAX(itemw(fit.next) + lrpad, fit.max);
+  if (fit.next == nitems)
+    snapwidths();
+  if (fit.next < nitems || fit.max == fit.textw)
+    return;
+  fit.textw = fit.max;
+  mw = centerw(fit.textw);
+  XMoveResizeWindow(dpy, win, fit.x + (fit.w - mw) / 2, fit.y,
+                    mw - border_width * 2, mh);
+  drw_resize(drw, mw, mh);
+  frame.valid = 0;
+  inputw = !draw_input ? 0 : mw / 3;
+  calcoffsets();
+  drawmenu();
+}
+
 static void run(void) {
   XEvent ev;
-  fd_set rfds;
-  int xfd = ConnectionNumber(dpy);
+  fd_set rfds, wfds;
+  struct timeval tv;
+  int xfd = ConnectionNumber(dpy), nfds, n;
 
   for (;;) {
     FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
     FD_SET(xfd, &rfds);
-    FD_SET(qalc.out[0], &rfds);
+    nfds = xfd;
+    if (qalc.enable) {
+      FD_SET(qalc.out[0], &rfds);
+      nfds = MAX(nfds, qalc.out[0]);
+    }
+    if (bg.started) {
+      FD_SET(bg.fd[0], &rfds);
+      nfds = MAX(nfds, bg.fd[0]);
+    }
+    /* the input only grows while no match pass reads it */
+    if (streaming && !matchpending)
+      FD_SET(STDIN_FILENO, &rfds);
+    if (prov.out >= 0) {
+      FD_SET(prov.out, &rfds);
+      nfds = MAX(nfds, prov.out);
+    }
+    if (prov.qlen) {
+      FD_SET(prov.in, &wfds);
+      nfds = MAX(nfds, prov.in);
+    }
 
-    if (select(MAX(xfd, qalc.out[0]) + 1, &rfds, NULL, NULL, NULL) > 0) {
+    /* items left to measure for -c wait until nothing else is to be done */
+    tv.tv_sec = tv.tv_usec = 0;
+    n = select(nfds + 1, &rfds, &wfds, NULL,
+               centered && fit.next < nitems ? &tv : NULL);
+    if (!n)
+      measurewidths();
+    if (n > 0) {
       if (qalc.enable && FD_ISSET(qalc.out[0], &rfds)) {
         recv_qalc();
         drawmenu();
       }
+      if (bg.started && FD_ISSET(bg.fd[0], &rfds) && matchpoll())
+        drawmenu();
+      if (streaming && !matchpending && FD_ISSET(STDIN_FILENO, &rfds))
+        streamitems();
+      if (prov.qlen && FD_ISSET(prov.in, &wfds))
+        flushprovider();
+      if (prov.out >= 0 && FD_ISSET(prov.out, &rfds) && readprovider())
+        redraw = 1;
       while (XPending(dpy) && !XNextEvent(dpy, &ev)) {
         if (XFilterEvent(&ev, win))
           continue;
@@ -1216,6 +3274,15 @@ static void run(void) {
           break;
         }
       }
+      /* text edits queued together cost a single match and redraw */
+      if (matchstale) {
+        matchstale = 0;
+        matchasync();
+      }
+      if (redraw) {
+        redraw = 0;
+        drawmenu();
+      }
     }
   }
 }
@@ -1279,7 +3346,9 @@ static void setup(void) {
           break;
 
     if (centered) {
-      mw = MIN(MAX(max_textw() + promptw, min_width), info[i].width);
+      fit.x = info[i].x_org;
+      fit.w = info[i].width;
+      mw = centerw(fit.textw = widestitem());
       x = info[i].x_org + ((info[i].width - mw) / 2);
       y = info[i].y_org + ((info[i].height - mh) / 2);
     } else {
@@ -1296,7 +3365,9 @@ static void setup(void) {
       die("could not get embedding window attributes: 0x%lx", parentwin);
 
     if (centered) {
-      mw = MIN(MAX(max_textw() + promptw, min_width), wa.width);
+      fit.x = 0;
+      fit.w = wa.width;
+      mw = centerw(fit.textw = widestitem());
       x = (wa.width - mw) / 2;
       y = (wa.height - mh) / 2;
     } else {
@@ -1308,22 +3379,22 @@ static void setup(void) {
   inputw = !draw_input ? 0 : mw / 3; /* input width: ~33% of monitor width */
   match();
   for (i = 0; i < preselected; i++) {
-    if (sel && sel->right && (sel = sel->right) == next) {
+    if (nmatches && sel + 1 < nmatches && ++sel == next) {
       curr = next;
       calcoffsets();
     }
   }
 
   /* create menu window */
+  fit.y = y - (topbar ? 0 : border_width * 2);
   swa.override_redirect = True;
   swa.background_pixel = 0;
   swa.border_pixel = 0;
   swa.colormap = cmap;
   swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask |
                    ButtonPressMask | PointerMotionMask;
-  win = XCreateWindow(dpy, parentwin, x, y - (topbar ? 0 : border_width * 2),
-                      mw - border_width * 2, mh, border_width, depth,
-                      CopyFromParent, visual,
+  win = XCreateWindow(dpy, parentwin, x, fit.y, mw - border_width * 2, mh,
+                      border_width, depth, CopyFromParent, visual,
                       CWOverrideRedirect | CWBackPixel | CWBorderPixel |
                           CWColormap | CWEventMask,
                       &swa);
@@ -1352,13 +3423,231 @@ static void setup(void) {
   drawmenu();
 }
 
+/* reads the output of cmd as the item set name */
+static void loadset(const char *name, const char *cmd) {
+  FILE *stream;
+
+  if (!(stream = popen(cmd, "r")))
+    die("could not popen %s:", cmd);
+  readstdin(stream);
+  pclose(stream);
+  if (!(sets = realloc(sets, (nsets + 1) * sizeof *sets)))
+    die("cannot realloc %zu bytes:", (nsets + 1) * sizeof *sets);
+  sets[nsets].name = name;
+  sets[nsets].text = inputtext;
+  sets[nsets].len = inputlen;
+  sets[nsets].siz = inputsiz;
+  sets[nsets].off = itemoff;
+  sets[nsets].wideoff = wideoff;
+  sets[nsets].mask = itemmask;
+  sets[nsets].flags = itemflags;
+  sets[nsets].n = nitems;
+  sets[nsets].nsiz = itemsiz;
+  nsets++;
+  /* the set owns the input now */
+  inputtext = inputkeys = NULL;
+  inputlen = inputsiz = 0;
+  itemoff = NULL;
+  wideoff = 0;
+  itemmask = NULL;
+  itemflags = NULL;
+  nitems = itemsiz = 0;
+}
+
+/* makes the item set name the input; the menu process owns its copy */
+static void useset(const char *name) {
+  size_t i;
+
+  for (i = 0; i < nsets && strcmp(sets[i].name, name); i++)
+    ;
+  if (i == nsets)
+    die("no item set %s", name);
+  inputtext = inputkeys = sets[i].text;
+  inputlen = sets[i].len;
+  inputsiz = sets[i].siz;
+  itemoff = sets[i].off;
+  wideoff = sets[i].wideoff;
+  itemmask = sets[i].mask;
+  itemflags = sets[i].flags;
+  nitems = sets[i].n;
+  itemsiz = sets[i].nsiz;
+  if (casefold) {
+    if (!(inputkeys = malloc(inputsiz)))
+      die("cannot malloc %zu bytes:", inputsiz);
+    searchfold(inputkeys, inputtext, inputlen);
+  }
+  markhp();
+  lines = MIN(max_lines, nitems);
+}
+
+static void initdisplay(void) {
+  if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
+    fputs("warning: no locale support\n", stderr);
+  searchinit();
+  if (!(dpy = XOpenDisplay(NULL)))
+    die("cannot open display");
+  screen = DefaultScreen(dpy);
+  root = RootWindow(dpy, screen);
+  xinitvisual();
+  /* setup() sizes it to the menu */
+  drw = drw_create(dpy, screen, root, DisplayWidth(dpy, screen),
+                   DisplayHeight(dpy, screen), visual, depth, cmap);
+}
+
+/* waits in a standby child of the daemon until it hands over a client
+ * connection, then takes the client's arguments and standard streams */
+static void takerequest(int sock, int *argc, char ***argv) {
+  int conn, fds[MAXFDS], i, n;
+  uint32_t len;
+  char c, *req, *p, **v;
+
+  if (recvfds(sock, &c, 1, &conn, 1) != 1)
+    exit(0); /* the daemon is gone */
+  close(sock);
+  if (recvfds(conn, &len, sizeof len, fds, MAXFDS) != MAXFDS)
+    die("incomplete request");
+  req = ecalloc(1, (size_t)len + 1);
+  if (readn(conn, req, len) < 0)
+    die("incomplete request");
+  close(conn);
+  /* serve() keeps 0, 1 and 2 open, so the descriptors arrive above them */
+  for (i = 0; i <= STDERR_FILENO; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  /* the client's working directory, for -cache paths and commands */
+  if (fchdir(fds[MAXFDS - 1]) < 0)
+    die("fchdir:");
+  close(fds[MAXFDS - 1]);
+  for (n = 0, p = req; p < req + len; p += strlen(p) + 1)
+    n++;
+  v = ecalloc(n + 2, sizeof *v);
+  v[0] = "dmenu";
+  for (i = 1, p = req; p < req + len; p += strlen(p) + 1)
+    v[i++] = p;
+  *argc = n + 1;
+  *argv = v;
+}
+
+static void sigchld(int unused) {}
+
+/* The daemon reads the item sets named on its command line, then keeps a
+ * standby child with the display and fonts open. A client connection goes
+ * to that child, which shows the menu for the request, and a new standby
+ * child is started for the next one; an Xlib connection cannot be shared
+ * across fork(), so each menu needs a process of its own. The daemon sends
+ * the client the exit status of its menu. Returns in the child that took a
+ * request, with the request's arguments. */
+static void serve(int *argc, char ***argv) {
+  struct sockaddr_un sa = {.sun_family = AF_UNIX};
+  struct sigaction sact = {.sa_handler = sigchld};
+  struct {
+    pid_t pid;
+    int conn;
+  } *sessions = NULL;
+  size_t nsessions = 0, i;
+  sigset_t block, orig;
+  fd_set rfds;
+  pid_t pid, spid = 0;
+  int lfd, conn, sock = -1, sv[2], status, r;
+  unsigned char code;
+
+  /* with stdio closed the socket, or a standby child's X connection, would
+   * become 0, 1 or 2 and be replaced by a client's descriptor */
+  while ((r = open("/dev/null", O_RDWR)) >= 0 && r <= STDERR_FILENO)
+    ;
+  if (r > STDERR_FILENO)
+    close(r);
+
+  /* the masks and keys of the sets are computed here, not in the children */
+  setlocale(LC_CTYPE, "");
+  searchinit();
+  for (r = 2; r < *argc; r += 3)
+    if (strcmp((*argv)[r], "-set") || r + 2 >= *argc)
+      usage();
+    else
+      loadset((*argv)[r + 1], (*argv)[r + 2]);
+
+  sockpath(sa.sun_path, sizeof sa.sun_path);
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    die("socket:");
+  unlink(sa.sun_path);
+  umask(077);
+  if (bind(lfd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(lfd, 8) < 0)
+    die("cannot listen on %s:", sa.sun_path);
+  /* SIGCHLD only interrupts pselect(), so that no exit goes unnoticed */
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &orig);
+  sigaction(SIGCHLD, &sact, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    if (!spid) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair:");
+      if ((spid = fork()) < 0)
+        die("fork:");
+      if (!spid) {
+        sigprocmask(SIG_SETMASK, &orig, NULL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        close(lfd);
+        close(sv[0]);
+        for (i = 0; i < nsessions; i++)
+          close(sessions[i].conn);
+        free(sessions);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        initdisplay();
+        if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+          die("no fonts could be loaded.");
+        takerequest(sv[1], argc, argv);
+        prctl(PR_SET_PDEATHSIG, 0);
+        return;
+      }
+      close(sv[1]);
+      sock = sv[0];
+    }
+    FD_ZERO(&rfds);
+    FD_SET(lfd, &rfds);
+    if ((r = pselect(lfd + 1, &rfds, NULL, NULL, NULL, &orig)) < 0 &&
+        errno != EINTR)
+      die("pselect:");
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      if (pid == spid)
+        die("the standby menu exited");
+      for (i = 0; i < nsessions && sessions[i].pid != pid; i++)
+        ;
+      if (i == nsessions)
+        continue;
+      code = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+      writen(sessions[i].conn, &code, 1);
+      close(sessions[i].conn);
+      sessions[i] = sessions[--nsessions];
+    }
+    if (r <= 0 || !FD_ISSET(lfd, &rfds) ||
+        (conn = accept(lfd, NULL, NULL)) < 0)
+      continue;
+    if (sendfds(sock, "", 1, &conn, 1) < 0)
+      die("cannot hand over request:");
+    close(sock);
+    if (!(sessions = realloc(sessions, (nsessions + 1) * sizeof *sessions)))
+      die("cannot realloc %zu bytes:", (nsessions + 1) * sizeof *sessions);
+    sessions[nsessions].pid = spid;
+    sessions[nsessions++].conn = conn;
+    spid = 0;
+  }
+}
+
 static void usage(void) {
-  die("usage: dmenu [-bCfiNvP] [-noi] [-l lines] [-h height] [-p prompt] [-fn "
+  die("usage: dmenu [-0bBCfHiNvPS] [-noi] [-stats] [-l lines] [-h height] [-p prompt] [-fn "
       "font] [-m monitor]\n"
       "             [-nb color] [-nf color] [-r] [-sb color] [-sf color] [-w "
       "windowid]\n"
       "             [-hb color] [-hf color] [-it text] [-hp items] [-dy "
-      "command]\n",
+      "command]\n"
+      "             [-dp command] [-t threads] [-set name] [-cache file]\n"
+      "       dmenu -daemon [-set name command]...\n",
       stderr);
   exit(1);
 }
@@ -1370,6 +3659,8 @@ int main(int argc, char *argv[]) {
   XrmInitialize();
   load_xresources();
 
+  if (argc > 1 && !strcmp(argv[1], "-daemon"))
+    serve(&argc, &argv);
   for (i = 1; i < argc; i++)
     /* these options take no arguments */
     if (!strcmp(argv[i], "-v")) { /* prints version information */
@@ -1379,6 +3670,14 @@ int main(int argc, char *argv[]) {
       topbar = 0;
     else if (!strcmp(argv[i], "-C")) /* grabs keyboard before reading stdin */
       qalc.enable = 1;
+    else if (!strcmp(argv[i], "-S")) /* shows the menu while reading stdin */
+      stream = 1;
+    else if (!strcmp(argv[i], "-0")) /* items are NUL-terminated */
+      nulsep = 1;
+    else if (!strcmp(argv[i], "-B")) /* items are length-prefixed records */
+      records = 1;
+    else if (!strcmp(argv[i], "-H")) /* ranks items chosen before first */
+      history = 1;
     else if (!strcmp(argv[i], "-f")) /* grabs keyboard before reading stdin */
       fast = 1;
     else if (!strcmp(argv[i], "-noi")) /* no input field. intended to be used
@@ -1390,13 +3689,14 @@ int main(int argc, char *argv[]) {
       centered = 1;
     else if (!strcmp(argv[i], "-F")) /* grabs keyboard before reading stdin */
       fuzzy = 0;
-    else if (!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
-      fstrncmp = strncasecmp;
-      fstrstr = cistrstr;
-    } else if (!strcmp(argv[i], "-P")) /* is the input a password */
+    else if (!strcmp(argv[i], "-i")) /* case-insensitive item matching */
+      casefold = 1;
+    else if (!strcmp(argv[i], "-P")) /* is the input a password */
       passwd = 1;
     else if (!strcmp(argv[i], "-ix")) /* adds ability to return index in list */
       print_index = 1;
+    else if (!strcmp(argv[i], "-stats")) /* report index sizes on stderr */
+      stats = 1;
     else if (!strcmp(argv[i], "-N")) { /* instant select only match */
       instant = 1;
     } else if (i + 1 == argc)
@@ -1432,50 +3732,87 @@ int main(int argc, char *argv[]) {
       insert(text, strlen(text));
     } else if (!strcmp(argv[i], "-n")) /* preselected item */
       preselected = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-t")) /* number of matcher threads */
+      threads = atoi(argv[++i]);
     else if (!strcmp(argv[i], "-bw"))
       border_width = atoi(argv[++i]); /* border width */
     else if (!strcmp(argv[i], "-hp"))
       parse_hpitems(argv[++i]);
     else if (!strcmp(argv[i], "-dy")) /* dynamic command to run */
       dynamic = argv[++i] && *argv[i] ? argv[i] : NULL;
+    else if (!strcmp(argv[i], "-dp")) /* long-lived command to query */
+      provider = argv[++i] && *argv[i] ? argv[i] : NULL;
+    else if (!strcmp(argv[i], "-set")) /* item set of the daemon */
+      setname = argv[++i];
+    else if (!strcmp(argv[i], "-cache")) /* snapshot of the parsed input */
+      snapfile = argv[++i];
     else
       usage();
 
-  if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
-    fputs("warning: no locale support\n", stderr);
-  if (!(dpy = XOpenDisplay(NULL)))
-    die("cannot open display");
-  screen = DefaultScreen(dpy);
-  root = RootWindow(dpy, screen);
+  if (nulsep || records)
+    delim = '\0';
+  if (!dpy)
+    initdisplay();
   if (!embed || !(parentwin = strtol(embed, NULL, 0)))
     parentwin = root;
   if (!XGetWindowAttributes(dpy, parentwin, &wa))
     die("could not get embedding window attributes: 0x%lx", parentwin);
-  xinitvisual();
-  drw = drw_create(dpy, screen, root, wa.width, wa.height, visual, depth, cmap);
-  if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+  /* the fonts of a daemon's menu are loaded already, unless -fn differs */
+  if (drw->fonts && fonts[0] != font) {
+    drw_fontset_free(drw->fonts);
+    drw->fonts = NULL;
+    dropwidths();
+  }
+  if (!drw->fonts && !drw_fontset_create(drw, fonts, LENGTH(fonts)))
     die("no fonts could be loaded.");
 
   lrpad = drw->fonts->h;
+  if (history && !passwd)
+    histopen();
 
 #ifdef __OpenBSD__
-  if (pledge("stdio rpath", NULL) == -1)
-    die("pledge");
+  {
+    /* -cache writes the snapshot, -dp, -dy and qalc run commands and the
+     * mapped -H history is locked for each update */
+    char promises[64] = "stdio rpath";
+
+    if (hist.slots)
+      strlcat(promises, " flock", sizeof promises);
+    if (snapfile)
+      strlcat(promises, " wpath cpath", sizeof promises);
+    if (provider || dynamic || qalc.enable)
+      strlcat(promises, " proc exec", sizeof promises);
+    if (pledge(promises, NULL) == -1)
+      die("pledge");
+  }
 #endif
 
   max_lines = lines;
+  if (hpitems && hplength > 0)
+    qsort(hpitems, hplength, sizeof *hpitems, str_compar);
   if (qalc.enable) {
     init_qalc();
     grabkeyboard();
+  } else if (provider) {
+    startprovider();
+    grabkeyboard();
+  } else if (setname) {
+    grabkeyboard();
+    useset(setname);
+  } else if (stream && !dynamic && !passwd && !isatty(0)) {
+    grabkeyboard();
+    streamstart();
   } else if (fast && !isatty(0)) {
     grabkeyboard();
     if (!dynamic)
-      readstdin(stdin);
+      readinput();
   } else {
     if (!dynamic)
-      readstdin(stdin);
+      readinput();
     grabkeyboard();
   }
+  tristart();
+  bgstart();
   setup();
   run();
 
@@ -0,0 +1,55 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Thin client for the dmenu daemon (dmenu -daemon): it hands its arguments,
+ * its stdin, stdout and stderr and its working directory to the daemon, which
+ * shows the menu in a child that has the display and fonts open already, and
+ * exits with the status of that menu. Without a daemon it runs dmenu itself.
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util.h"
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	int fd, i, fds[] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+	uint32_t len = 0;
+	unsigned char status;
+	char *req, *p;
+
+	sockpath(sa.sun_path, sizeof(sa.sun_path));
+	/* only a daemon of the same user gets our file descriptors; the menu
+	 * resolves relative paths and runs commands in our directory */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+	    cred.uid != getuid() ||
+	    (fds[3] = open(".", O_RDONLY | O_CLOEXEC)) < 0) {
+		argv[0] = "dmenu";
+		execvp(argv[0], argv);
+		die("execvp dmenu:");
+	}
+
+	/* the arguments, each terminated by a NUL */
+	for (i = 1; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	p = req = ecalloc(1, len + 1);
+	for (i = 1; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+	if (sendfds(fd, &len, sizeof(len), fds, MAXFDS) < 0 ||
+	    writen(fd, req, len) < 0)
+		die("cannot send request:");
+	if (readn(fd, &status, 1) < 0)
+		die("dmenu daemon hung up");
+	return status;
+}
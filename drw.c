@@ -91,11 +91,15 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	if (drw->xftdraw)
+		XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	if (drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
@@ -153,6 +157,8 @@ xfont_free(Fnt *font)
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
 	XftFontClose(font->dpy, font->xfont);
+	free(font->latin);
+	free(font->glyphs);
 	free(font);
 }
 
@@ -227,6 +233,26 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+/* Text drawn between drw_frame_begin() and drw_frame_end() goes through one
+ * XftDraw of the drawable, made on the first frame and kept, instead of one
+ * made and destroyed per drw_text() call. */
+void
+drw_frame_begin(Drw *drw)
+{
+	if (!drw)
+		return;
+	if (!drw->xftdraw)
+		drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+	drw->inframe = 1;
+}
+
+void
+drw_frame_end(Drw *drw)
+{
+	if (drw)
+		drw->inframe = 0;
+}
+
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
@@ -239,6 +265,95 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+/* stands in the glyph cache for the font of a codepoint no font has */
+static Fnt nofont;
+
+static Chr *
+glyph_slot(Chr *glyphs, size_t size, long u)
+{
+	size_t i;
+
+	for (i = u & (size - 1); glyphs[i].font && glyphs[i].u != u; i = (i + 1) & (size - 1))
+		;
+	return &glyphs[i];
+}
+
+/* Rebuilds the hashed part of the glyph cache of set with size entries,
+ * leaving out the codepoints no font had unless keepmisses. */
+static void
+glyph_rehash(Fnt *set, size_t size, int keepmisses)
+{
+	Chr *old = set->glyphs;
+	size_t i, oldsiz = set->glyphsiz;
+
+	set->glyphs = ecalloc(size, sizeof(Chr));
+	set->glyphsiz = size;
+	set->nglyphs = 0;
+	for (i = 0; i < oldsiz; i++) {
+		if (old[i].font && (keepmisses || old[i].font != &nofont)) {
+			*glyph_slot(set->glyphs, size, old[i].u) = old[i];
+			set->nglyphs++;
+		}
+	}
+	free(old);
+}
+
+/* Forgets which codepoints no font of set has, once it gained a font. */
+static void
+glyph_forget_misses(Fnt *set)
+{
+	size_t i;
+
+	if (set->latin)
+		for (i = 0; i < 0x100; i++)
+			if (set->latin[i].font == &nofont)
+				set->latin[i].font = NULL;
+	if (set->glyphs)
+		glyph_rehash(set, set->glyphsiz, 0);
+}
+
+/* Returns the first font of the set that has codepoint u, which s encodes
+ * in len bytes, and its advance, or NULL if none has it. Only the first
+ * lookup of a codepoint asks Xft, the set's glyph cache answers the rest:
+ * for a codepoint no font had then, &nofont. */
+static Fnt *
+drw_glyph(Drw *drw, long u, const char *s, unsigned int len, unsigned int *w)
+{
+	Fnt *set = drw->fonts, *font;
+	Chr *g;
+
+	/* invalid sequences are measured as they are */
+	if (u == UTF_INVALID) {
+		g = NULL;
+	} else if (u < 0x100) {
+		if (!set->latin)
+			set->latin = ecalloc(0x100, sizeof(Chr));
+		g = &set->latin[u];
+	} else {
+		if (set->nglyphs + 1 > set->glyphsiz / 4 * 3)
+			glyph_rehash(set, set->glyphsiz ? set->glyphsiz * 2 : 256, 1);
+		g = glyph_slot(set->glyphs, set->glyphsiz, u);
+	}
+	if (g && g->font) {
+		*w = g->w;
+		return g->font;
+	}
+
+	for (font = set; font; font = font->next)
+		if (XftCharExists(drw->dpy, font->xfont, u))
+			break;
+	if (font)
+		drw_font_getexts(font, s, len, w, NULL);
+	if (g) {
+		g->u = u;
+		g->font = font ? font : &nofont;
+		g->w = font ? *w : 0;
+		if (u >= 0x100)
+			set->nglyphs++;
+	}
+	return font;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
@@ -253,7 +368,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	FcPattern *fcpattern;
 	FcPattern *match;
 	XftResult result;
-	int charexists = 0, overflow = 0;
+	int charexists = 0, overflow = 0, searched = 0;
 	/* keep track of a couple codepoints for which we have no match. */
 	enum { nomatches_len = 64 };
 	static struct { long codepoint[nomatches_len]; unsigned int idx; } nomatches;
@@ -267,7 +382,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		d = drw->inframe ? drw->xftdraw : XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
 		x += lpad;
 		w -= lpad;
 	}
@@ -281,34 +396,39 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
-					if (ew + ellipsis_width <= w) {
-						/* keep track where the ellipsis still fits */
-						ellipsis_x = x + ew;
-						ellipsis_w = w - ew;
-						ellipsis_len = utf8strlen;
-					}
-
-					if (ew + tmpw > w) {
-						overflow = 1;
-						/* called from drw_fontset_getwidth_clamp():
-						 * it wants the width AFTER the overflow
-						 */
-						if (!render)
-							x += tmpw;
-						else
-							utf8strlen = ellipsis_len;
-					} else if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-						ew += tmpw;
-					} else {
-						nextfont = curfont;
-					}
-					break;
+			if (charexists) {
+				/* no font has it, the first one draws it anyway */
+				curfont = drw->fonts;
+				drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
+			} else {
+				curfont = drw_glyph(drw, utf8codepoint, text, utf8charlen, &tmpw);
+				/* the fallback fonts were searched for it before */
+				searched = curfont == &nofont;
+				charexists = curfont && !searched;
+			}
+			if (charexists) {
+				if (ew + ellipsis_width <= w) {
+					/* keep track where the ellipsis still fits */
+					ellipsis_x = x + ew;
+					ellipsis_w = w - ew;
+					ellipsis_len = utf8strlen;
+				}
+
+				if (ew + tmpw > w) {
+					overflow = 1;
+					/* called from drw_fontset_getwidth_clamp():
+					 * it wants the width AFTER the overflow
+					 */
+					if (!render)
+						x += tmpw;
+					else
+						utf8strlen = ellipsis_len;
+				} else if (curfont == usedfont) {
+					utf8strlen += utf8charlen;
+					text += utf8charlen;
+					ew += tmpw;
+				} else {
+					nextfont = curfont;
 				}
 			}
 
@@ -340,6 +460,8 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			 * character must be drawn. */
 			charexists = 1;
 
+			if (searched)
+				goto no_match;
 			for (i = 0; i < nomatches_len; ++i) {
 				/* avoid calling XftFontMatch if we know we won't find a match */
 				if (utf8codepoint == nomatches.codepoint[i])
@@ -371,6 +493,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
 						; /* NOP */
 					curfont->next = usedfont;
+					glyph_forget_misses(drw->fonts);
 				} else {
 					xfont_free(usedfont);
 					nomatches.codepoint[++nomatches.idx % nomatches_len] = utf8codepoint;
@@ -380,7 +503,7 @@ no_match:
 			}
 		}
 	}
-	if (d)
+	if (d && d != drw->xftdraw)
 		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
@@ -393,7 +516,8 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 		return;
 
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	/* send the frame without waiting for the server to have drawn it */
+	XFlush(drw->dpy);
 }
 
 unsigned int
@@ -4,11 +4,22 @@ typedef struct {
 	Cursor cursor;
 } Cur;
 
+/* a codepoint, the font of the set that has it, if any, and its advance */
+typedef struct {
+	long u;
+	struct Fnt *font; /* NULL while the entry is unused */
+	unsigned int w;
+} Chr;
+
 typedef struct Fnt {
 	Display *dpy;
 	unsigned int h;
 	XftFont *xfont;
 	FcPattern *pattern;
+	/* glyph cache of the set this font heads: U+0000 to U+00FF by
+	 * codepoint, the others hashed */
+	Chr *latin, *glyphs;
+	size_t nglyphs, glyphsiz;
 	struct Fnt *next;
 } Fnt;
 
@@ -24,6 +35,8 @@ typedef struct {
 	unsigned int depth;
 	Colormap cmap;
 	Drawable drawable;
+	XftDraw *xftdraw; /* of drawable, kept from frame to frame */
+	int inframe;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
@@ -53,6 +66,8 @@ void drw_setfontset(Drw *drw, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
 
 /* Drawing functions */
+void drw_frame_begin(Drw *drw);
+void drw_frame_end(Drw *drw);
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 
@@ -0,0 +1,125 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#include "search.h"
+
+typedef char *(*Kernel)(const char *h, size_t hl, const char *n, size_t nl);
+
+static unsigned char fold[256];
+static uint64_t classbit[256];
+static Kernel strkernel;
+
+#ifdef SEARCH_X86
+/* The kernels compare the first and the last needle byte against a whole
+ * vector of candidate positions at once and only look at the bytes in between
+ * for the positions where both matched. */
+
+#define KERNEL(name, isa, vec, width, load, eq, and, movemask)                 \
+__attribute__((target(isa)))                                                  \
+static char *                                                                  \
+name(const char *h, size_t hl, const char *n, size_t nl)                       \
+{                                                                              \
+	unsigned char f = (unsigned char)n[0], l = (unsigned char)n[nl - 1];       \
+	const vec first = set1((char)f), last = set1((char)l);                     \
+	size_t i, end = hl - nl;                                                   \
+	unsigned int mask, bit;                                                    \
+	vec a, b;                                                                  \
+                                                                               \
+	for (i = 0; i + width <= end + 1; i += width) {                            \
+		a = load((const vec *)(h + i));                                        \
+		b = load((const vec *)(h + i + nl - 1));                               \
+		mask = (unsigned int)movemask(and(eq(a, first), eq(b, last)));         \
+		for (; mask; mask &= mask - 1) {                                       \
+			bit = __builtin_ctz(mask);                                         \
+			if (!memcmp(h + i + bit + 1, n + 1, nl - 2))                       \
+				return (char *)h + i + bit;                                    \
+		}                                                                      \
+	}                                                                          \
+	for (; i <= end; i++)                                                      \
+		if ((unsigned char)h[i] == f && (unsigned char)h[i + nl - 1] == l &&   \
+		    !memcmp(h + i + 1, n + 1, nl - 2))                                 \
+			return (char *)h + i;                                              \
+	return NULL;                                                               \
+}
+
+#define set1 _mm_set1_epi8
+KERNEL(str_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_cmpeq_epi8,
+       _mm_and_si128, _mm_movemask_epi8)
+#undef set1
+#define set1 _mm256_set1_epi8
+KERNEL(str_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_cmpeq_epi8,
+       _mm256_and_si256, _mm256_movemask_epi8)
+#undef set1
+#endif /* SEARCH_X86 */
+
+void
+searchinit(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++)
+		fold[c] = tolower(c);
+	/* letters and digits get a class each, the remaining ASCII bytes share
+	 * 27 classes and all other bytes the last one */
+	for (c = 1; c < 256; c++) {
+		if (fold[c] >= 'a' && fold[c] <= 'z')
+			classbit[c] = (uint64_t)1 << (fold[c] - 'a');
+		else if (fold[c] >= '0' && fold[c] <= '9')
+			classbit[c] = (uint64_t)1 << (26 + fold[c] - '0');
+		else if (fold[c] < 0x80)
+			classbit[c] = (uint64_t)1 << (36 + fold[c] % 27);
+		else
+			classbit[c] = (uint64_t)1 << 63;
+	}
+	strkernel = NULL;
+#ifdef SEARCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		strkernel = str_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		strkernel = str_sse2;
+#endif
+}
+
+char *
+searchstr(const char *h, const char *n)
+{
+	size_t hl, nl;
+
+	if (!n[0])
+		return (char *)h;
+	if (!n[1])
+		return strchr(h, n[0]);
+	if (!strkernel)
+		return strstr(h, n);
+	if ((hl = strlen(h)) < (nl = strlen(n)))
+		return NULL;
+	return strkernel(h, hl, n, nl);
+}
+
+void
+searchfold(char *dst, const char *src, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = fold[(unsigned char)src[i]];
+}
+
+uint64_t
+searchmask(const char *s)
+{
+	uint64_t mask = 0;
+
+	for (; *s; s++)
+		mask |= classbit[(unsigned char)*s];
+	return mask;
+}
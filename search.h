@@ -0,0 +1,14 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Substring search, a drop-in replacement for strstr(3). searchinit() has to
+ * be called after setlocale(3); it picks the fastest kernel the running CPU
+ * supports and sets up the case-folding table. */
+void searchinit(void);
+char *searchstr(const char *h, const char *n);
+
+/* Copies n bytes from src to dst, case-folded with tolower(3). */
+void searchfold(char *dst, const char *src, size_t n);
+
+/* Set of the case-folded byte classes occurring in s. A string can only
+ * contain another one, in any case, when its mask covers the other's. */
+uint64_t searchmask(const char *s);
@@ -1,8 +1,11 @@
 /* See LICENSE file for copyright and license details. */
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -34,3 +37,126 @@ ecalloc(size_t nmemb, size_t size)
 		die("calloc:");
 	return p;
 }
+
+/* Path of the socket the dmenu daemon of this user and display listens on. */
+void
+sockpath(char *buf, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR"), *dpy = getenv("DISPLAY");
+	int n;
+
+	if (!dpy)
+		dpy = "";
+	if (dir && *dir)
+		n = snprintf(buf, size, "%s/dmenu%s", dir, dpy);
+	else
+		n = snprintf(buf, size, "/tmp/dmenu-%u%s", (unsigned int)getuid(), dpy);
+	if (n < 0 || (size_t)n >= size)
+		die("socket path too long");
+}
+
+int
+readn(int fd, void *buf, size_t n)
+{
+	ssize_t r;
+
+	while (n) {
+		if ((r = read(fd, buf, n)) < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf = (char *)buf + r;
+		n -= r;
+	}
+	return 0;
+}
+
+int
+writen(int fd, const void *buf, size_t n)
+{
+	ssize_t r;
+
+	while (n) {
+		if ((r = write(fd, buf, n)) < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		buf = (const char *)buf + r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* Sends the n bytes at buf over the socket together with nfds file
+ * descriptors; buf has to hold at least one byte. */
+int
+sendfds(int sock, const void *buf, size_t n, const int *fds, int nfds)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(MAXFDS * sizeof(int))];
+	} ctl;
+	struct iovec iov = { (void *)buf, n };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	if (nfds > MAXFDS)
+		return -1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.b;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	while ((r = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+		;
+	if (r < 0)
+		return -1;
+	return writen(sock, (const char *)buf + r, n - r);
+}
+
+/* Receives n bytes into buf along with up to nfds file descriptors sent by
+ * sendfds(), returns how many descriptors arrived or -1. */
+int
+recvfds(int sock, void *buf, size_t n, int *fds, int nfds)
+{
+	union {
+		struct cmsghdr h;
+		char b[CMSG_SPACE(MAXFDS * sizeof(int))];
+	} ctl;
+	struct iovec iov = { buf, n };
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	int i, got = 0, *p;
+	ssize_t r;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.b;
+	msg.msg_controllen = sizeof ctl.b;
+	while ((r = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR)
+		;
+	if (r <= 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		p = (int *)CMSG_DATA(cmsg);
+		for (i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++) {
+			if (got < nfds)
+				fds[got++] = p[i];
+			else
+				close(p[i]);
+		}
+	}
+	if (readn(sock, (char *)buf + r, n - r) < 0) {
+		for (i = 0; i < got; i++)
+			close(fds[i]);
+		return -1;
+	}
+	return got;
+}
@@ -6,3 +6,12 @@
 
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+
+/* the dmenu daemon, see dmenuc.c */
+#define MAXFDS                  4 /* stdin, stdout, stderr and cwd */
+
+void sockpath(char *buf, size_t size);
+int readn(int fd, void *buf, size_t n);
+int writen(int fd, const void *buf, size_t n);
+int sendfds(int sock, const void *buf, size_t n, const int *fds, int nfds);
+int recvfds(int sock, void *buf, size_t n, int *fds, int nfds);